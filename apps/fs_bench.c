@@ -0,0 +1,509 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Benchmark parameters, set from the command line */
+struct bench_opts {
+	size_t file_size;	/* size of each thread's file */
+	size_t io_size;		/* bytes per read or write */
+	size_t append_size;	/* bytes per append */
+	int ops;		/* operations per thread (random, append, churn...) */
+	int threads;
+	struct fs_mount_opts mount;
+	int json;
+};
+
+static struct bench_opts opts = {
+	.file_size = 1 << 20,
+	.io_size = 4096,
+	.append_size = 64,
+	.ops = 1000,
+	.threads = 1,
+	.mount = {
+		.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+		.fat_cache_blocks = FS_FAT_CACHE_DEFAULT_BLOCKS,
+	},
+};
+
+struct workload;
+
+/* State of one benchmark thread */
+struct worker {
+	int id;
+	const struct workload *w;
+	char filename[FS_FILENAME_LEN];
+	char *buf;
+	unsigned int seed;
+	uint64_t *lat;		/* latency of each operation, in nanoseconds */
+	size_t nlat;
+	size_t bytes;
+	int errors;
+	pthread_barrier_t *start;
+};
+
+struct workload {
+	const char *name;
+	/* Untimed set up of the thread's file, before the clock starts */
+	void (*prepare)(struct worker *wk);
+	void (*run)(struct worker *wk);
+	/* Upper bound on the number of operations of one thread */
+	size_t (*max_ops)(void);
+	/* Whether the workload changes the disk (the final fs_sync() counts) */
+	int writes;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#define TIMED(wk, expr)					\
+({							\
+	uint64_t __t0 = now_ns();			\
+	int __ret = (expr);				\
+	(wk)->lat[(wk)->nlat++] = now_ns() - __t0;	\
+	__ret;						\
+})
+
+/* Fills the thread's empty file with @size bytes */
+static void make_file(struct worker *wk, size_t size)
+{
+	size_t cur = 0;
+	int fd;
+
+	fd = fs_open(wk->filename);
+	if (fd < 0)
+		die("Cannot open file '%s'", wk->filename);
+	while (cur < size) {
+		size_t n = size - cur < opts.io_size ? size - cur : opts.io_size;
+		int ret = fs_write(fd, wk->buf, n);
+
+		if (ret <= 0)
+			die("Disk full while preparing '%s'", wk->filename);
+		cur += ret;
+	}
+	fs_close(fd);
+}
+
+/* Leaves the thread's file empty */
+static void fresh_file(struct worker *wk)
+{
+	fs_delete(wk->filename);
+	if (fs_create(wk->filename))
+		die("Cannot create file '%s'", wk->filename);
+}
+
+static void full_file(struct worker *wk)
+{
+	fresh_file(wk);
+	make_file(wk, opts.file_size);
+}
+
+static size_t seq_ops(void)
+{
+	return (opts.file_size + opts.io_size - 1) / opts.io_size;
+}
+
+static size_t count_ops(void)
+{
+	return opts.ops;
+}
+
+static size_t churn_ops(void)
+{
+	return 2 * (size_t)opts.ops;
+}
+
+static int open_file(struct worker *wk)
+{
+	int fd = fs_open(wk->filename);
+
+	if (fd < 0)
+		die("Cannot open file '%s'", wk->filename);
+	return fd;
+}
+
+static void run_seqwrite(struct worker *wk)
+{
+	int fd = open_file(wk);
+	size_t done = 0;
+
+	while (done < opts.file_size) {
+		size_t n = opts.file_size - done;
+		int ret;
+
+		if (n > opts.io_size)
+			n = opts.io_size;
+		ret = TIMED(wk, fs_write(fd, wk->buf, n));
+		if (ret <= 0) {
+			wk->errors++;
+			break;
+		}
+		done += ret;
+	}
+	wk->bytes = done;
+	fs_close(fd);
+}
+
+static void run_seqread(struct worker *wk)
+{
+	int fd = open_file(wk);
+
+	while (wk->bytes < opts.file_size) {
+		int ret = TIMED(wk, fs_read(fd, wk->buf, opts.io_size));
+
+		if (ret <= 0) {
+			wk->errors++;
+			break;
+		}
+		wk->bytes += ret;
+	}
+	fs_close(fd);
+}
+
+/* Random offset of a whole I/O within the file */
+static size_t random_offset(struct worker *wk)
+{
+	size_t slots = opts.file_size / opts.io_size;
+
+	if (slots == 0)
+		return 0;
+	return (size_t)rand_r(&wk->seed) % slots * opts.io_size;
+}
+
+static void run_random(struct worker *wk, int write)
+{
+	int fd = open_file(wk);
+
+	for (int i = 0; i < opts.ops; i++) {
+		size_t offset = random_offset(wk);
+		int ret;
+
+		/* The seek only moves the file offset, so it is left out */
+		fs_lseek(fd, offset);
+		if (write)
+			ret = TIMED(wk, fs_write(fd, wk->buf, opts.io_size));
+		else
+			ret = TIMED(wk, fs_read(fd, wk->buf, opts.io_size));
+		if (ret < 0)
+			wk->errors++;
+		else
+			wk->bytes += ret;
+	}
+	fs_close(fd);
+}
+
+static void run_randread(struct worker *wk)
+{
+	run_random(wk, 0);
+}
+
+static void run_randwrite(struct worker *wk)
+{
+	run_random(wk, 1);
+}
+
+static void run_append(struct worker *wk)
+{
+	int fd = open_file(wk);
+
+	for (int i = 0; i < opts.ops; i++) {
+		int ret = TIMED(wk, fs_write(fd, wk->buf, opts.append_size));
+
+		if (ret <= 0)
+			wk->errors++;
+		else
+			wk->bytes += ret;
+	}
+	fs_close(fd);
+}
+
+static void run_churn(struct worker *wk)
+{
+	char name[FS_FILENAME_LEN];
+
+	for (int i = 0; i < opts.ops; i++) {
+		snprintf(name, sizeof(name), "c%d_%d", wk->id, i);
+		if (TIMED(wk, fs_create(name)))
+			wk->errors++;
+		if (TIMED(wk, fs_delete(name)))
+			wk->errors++;
+	}
+}
+
+static int open_close(const char *filename)
+{
+	int fd = fs_open(filename);
+
+	return fd < 0 ? -1 : fs_close(fd);
+}
+
+static void run_openclose(struct worker *wk)
+{
+	for (int i = 0; i < opts.ops; i++)
+		if (TIMED(wk, open_close(wk->filename)))
+			wk->errors++;
+}
+
+static const struct workload workloads[] = {
+	{ "seqwrite",	fresh_file,	run_seqwrite,	seq_ops,	1 },
+	{ "seqread",	full_file,	run_seqread,	seq_ops,	0 },
+	{ "randwrite",	full_file,	run_randwrite,	count_ops,	1 },
+	{ "randread",	full_file,	run_randread,	count_ops,	0 },
+	{ "append",	fresh_file,	run_append,	count_ops,	1 },
+	{ "churn",	NULL,		run_churn,	churn_ops,	1 },
+	{ "openclose",	full_file,	run_openclose,	count_ops,	0 },
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *wk = arg;
+
+	if (wk->w->prepare)
+		wk->w->prepare(wk);
+	pthread_barrier_wait(wk->start);
+	wk->w->run(wk);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency at quantile @q of the sorted @lat, in microseconds */
+static double percentile(const uint64_t *lat, size_t n, double q)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+	i = (size_t)(q * n);
+	if (i >= n)
+		i = n - 1;
+	return lat[i] / 1000.0;
+}
+
+static void run_workload(const struct workload *w, int first)
+{
+	pthread_t tids[FS_OPEN_MAX_COUNT];
+	struct worker wks[FS_OPEN_MAX_COUNT];
+	pthread_barrier_t start;
+	size_t max_ops = w->max_ops() + 1;
+	size_t nlat = 0, bytes = 0;
+	int errors = 0;
+	uint64_t t0, t1;
+	uint64_t *lat;
+	double secs;
+
+	pthread_barrier_init(&start, NULL, opts.threads + 1);
+	for (int i = 0; i < opts.threads; i++) {
+		struct worker *wk = &wks[i];
+
+		memset(wk, 0, sizeof(*wk));
+		wk->id = i;
+		wk->w = w;
+		snprintf(wk->filename, sizeof(wk->filename), "bench%d", i);
+		wk->buf = malloc(opts.io_size > opts.append_size ?
+				 opts.io_size : opts.append_size);
+		wk->lat = malloc(max_ops * sizeof(*wk->lat));
+		wk->seed = i + 1;
+		wk->start = &start;
+		if (!wk->buf || !wk->lat)
+			die("Cannot malloc");
+		memset(wk->buf, 'a' + i % 26, opts.io_size > opts.append_size ?
+		       opts.io_size : opts.append_size);
+		if (pthread_create(&tids[i], NULL, worker_main, wk))
+			die("Cannot create thread");
+	}
+
+	pthread_barrier_wait(&start);
+	t0 = now_ns();
+	for (int i = 0; i < opts.threads; i++)
+		pthread_join(tids[i], NULL);
+	/* Written data has to reach the disk to count */
+	if (w->writes && fs_sync())
+		errors++;
+	t1 = now_ns();
+	pthread_barrier_destroy(&start);
+
+	for (int i = 0; i < opts.threads; i++)
+		nlat += wks[i].nlat;
+	lat = malloc((nlat ? nlat : 1) * sizeof(*lat));
+	if (!lat)
+		die("Cannot malloc");
+	nlat = 0;
+	for (int i = 0; i < opts.threads; i++) {
+		memcpy(&lat[nlat], wks[i].lat, wks[i].nlat * sizeof(*lat));
+		nlat += wks[i].nlat;
+		bytes += wks[i].bytes;
+		errors += wks[i].errors;
+		free(wks[i].lat);
+		free(wks[i].buf);
+	}
+	qsort(lat, nlat, sizeof(*lat), cmp_u64);
+	secs = (t1 - t0) / 1e9;
+
+	if (opts.json) {
+		printf("%s\n    {\"workload\": \"%s\", \"ops\": %zu, "
+		       "\"bytes\": %zu, \"seconds\": %.6f, \"mb_per_s\": %.2f, "
+		       "\"ops_per_s\": %.1f, \"errors\": %d, "
+		       "\"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, "
+		       "\"p999\": %.2f}}",
+		       first ? "" : ",", w->name, nlat, bytes, secs,
+		       bytes / 1e6 / secs, nlat / secs, errors,
+		       percentile(lat, nlat, 0.50), percentile(lat, nlat, 0.99),
+		       percentile(lat, nlat, 0.999));
+	} else {
+		printf("%-10s %8zu ops %10.2f MB/s %12.1f ops/s  "
+		       "p50 %9.2f us  p99 %9.2f us  p999 %9.2f us",
+		       w->name, nlat, bytes / 1e6 / secs, nlat / secs,
+		       percentile(lat, nlat, 0.50), percentile(lat, nlat, 0.99),
+		       percentile(lat, nlat, 0.999));
+		if (errors)
+			printf("  (%d errors)", errors);
+		printf("\n");
+	}
+	fflush(stdout);
+	free(lat);
+}
+
+static const struct workload *find_workload(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(workloads); i++)
+		if (!strcmp(name, workloads[i].name))
+			return &workloads[i];
+	return NULL;
+}
+
+static size_t get_size(const char *arg)
+{
+	char *end;
+	unsigned long long v;
+
+	errno = 0;
+	v = strtoull(arg, &end, 0);
+	if (errno || end == arg)
+		die("Invalid number '%s'", arg);
+	switch (*end) {
+	case 'k': case 'K': v <<= 10; end++; break;
+	case 'm': case 'M': v <<= 20; end++; break;
+	}
+	if (*end != '\0')
+		die("Invalid number '%s'", arg);
+	return v;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [<options>] <diskname> [<workload>...]\n",
+		program);
+	fprintf(stderr, "Options:\n"
+		"\t-s <size>\tfile size per thread (default 1M)\n"
+		"\t-b <size>\tbytes per read or write (default 4096)\n"
+		"\t-a <size>\tbytes per append (default 64)\n"
+		"\t-n <count>\toperations per thread for random, append, churn\n"
+		"\t\t\tand openclose workloads (default 1000)\n"
+		"\t-t <count>\tthreads (default 1, at most %d)\n"
+		"\t-c <blocks>\tblock cache size (default %d)\n"
+		"\t-f <blocks>\tFAT blocks kept in memory (default %d, 0 for all)\n"
+		"\t-m\t\tmap the virtual disk in memory\n"
+		"\t-j\t\treport in JSON\n", FS_OPEN_MAX_COUNT,
+		FS_CACHE_DEFAULT_BLOCKS, FS_FAT_CACHE_DEFAULT_BLOCKS);
+	fprintf(stderr, "Workloads (all of them by default):\n");
+	for (size_t i = 0; i < ARRAY_SIZE(workloads); i++)
+		fprintf(stderr, "\t%s\n", workloads[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const struct workload *selected[ARRAY_SIZE(workloads)];
+	size_t nselected = 0;
+	char *diskname;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:a:n:t:c:f:mj")) != -1) {
+		switch (opt) {
+		case 's': opts.file_size = get_size(optarg); break;
+		case 'b': opts.io_size = get_size(optarg); break;
+		case 'a': opts.append_size = get_size(optarg); break;
+		case 'n': opts.ops = get_size(optarg); break;
+		case 't': opts.threads = get_size(optarg); break;
+		case 'c': opts.mount.cache_blocks = get_size(optarg); break;
+		case 'f': opts.mount.fat_cache_blocks = get_size(optarg); break;
+		case 'm': opts.mount.mmap_disk = 1; break;
+		case 'j': opts.json = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+	if (opts.threads < 1 || opts.threads > FS_OPEN_MAX_COUNT ||
+	    opts.io_size == 0 || opts.append_size == 0)
+		usage(argv[0]);
+	diskname = argv[optind++];
+
+	for (; optind < argc; optind++) {
+		const struct workload *w = find_workload(argv[optind]);
+
+		if (!w || nselected == ARRAY_SIZE(selected))
+			die("invalid workload '%s'", argv[optind]);
+		selected[nselected++] = w;
+	}
+	if (nselected == 0)
+		for (size_t i = 0; i < ARRAY_SIZE(workloads); i++)
+			selected[nselected++] = &workloads[i];
+
+	if (fs_mount_ex(diskname, &opts.mount))
+		die("Cannot mount diskname");
+
+	if (opts.json)
+		printf("{\n  \"disk\": \"%s\", \"threads\": %d, "
+		       "\"file_size\": %zu, \"io_size\": %zu, "
+		       "\"append_size\": %zu, \"ops\": %d, "
+		       "\"cache_blocks\": %zu, \"mmap\": %d,\n  \"results\": [",
+		       diskname, opts.threads, opts.file_size, opts.io_size,
+		       opts.append_size, opts.ops, opts.mount.cache_blocks,
+		       opts.mount.mmap_disk);
+	for (size_t i = 0; i < nselected; i++)
+		run_workload(selected[i], i == 0);
+	if (opts.json)
+		printf("\n  ]\n}\n");
+
+	/* Leave the disk as it was found */
+	for (int i = 0; i < opts.threads; i++) {
+		char name[FS_FILENAME_LEN];
+
+		snprintf(name, sizeof(name), "bench%d", i);
+		fs_delete(name);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
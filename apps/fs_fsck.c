@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/* Exit codes, as those of e2fsck */
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [<options>] <diskname>\n", program);
+	fprintf(stderr, "Options:\n"
+		"\t-t <count>\tthreads walking file chains (default one per CPU)\n"
+		"\t-r\t\trepair the problems found\n"
+		"\t-v\t\tprint each problem\n");
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_check_opts opts = { 0 };
+	struct fs_check_report report;
+	int opt, problems;
+
+	while ((opt = getopt(argc, argv, "t:rv")) != -1) {
+		switch (opt) {
+		case 't': opts.threads = atoi(optarg); break;
+		case 'r': opts.repair = 1; break;
+		case 'v': opts.verbose = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1)
+		usage(argv[0]);
+
+	problems = fs_check(argv[optind], &opts, &report);
+	if (problems < 0) {
+		fprintf(stderr, "%s: cannot check '%s'\n", argv[0], argv[optind]);
+		return FSCK_ERROR;
+	}
+
+	printf("files=%zu\n", report.files);
+	printf("dirs=%zu\n", report.dirs);
+	printf("used_blocks=%zu\n", report.used_blocks);
+	printf("free_blocks=%zu\n", report.free_blocks);
+	printf("bad_pointers=%zu\n", report.bad_pointers);
+	printf("cycles=%zu\n", report.cycles);
+	printf("cross_links=%zu\n", report.cross_links);
+	printf("orphans=%zu\n", report.orphans);
+	printf("size_mismatches=%zu\n", report.size_mismatches);
+
+	if (!problems)
+		return FSCK_OK;
+	return opts.repair ? FSCK_REPAIRED : FSCK_UNCORRECTED;
+}
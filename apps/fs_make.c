@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define fs_make_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_make_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+static size_t get_count(const char *arg)
+{
+	char *end;
+	long long ret = strtoll(arg, &end, 0);
+
+	if (*arg == '\0' || *end != '\0' || ret < 0)
+		die("invalid number '%s'", arg);
+	return (size_t)ret;
+}
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [<options>] <diskname> <data block count>\n",
+		program);
+	fprintf(stderr, "Options:\n"
+		"\t-r <blocks>\troot directory blocks, %d entries each (default 1)\n"
+		"\t-j <blocks>\tjournal blocks, at least 3 (default none)\n"
+		"\t-s\t\tlet files have holes\n"
+		"\t-i\t\tkeep small files in their directory\n"
+		"With -s or -i, older implementations refuse the disk.\n",
+		FS_FILE_MAX_COUNT);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { .root_blocks = 1 };
+	size_t data_blocks;
+	char *diskname;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:j:si")) != -1) {
+		switch (opt) {
+		case 'r': opts.root_blocks = get_count(optarg); break;
+		case 'j': opts.journal_blocks = get_count(optarg); break;
+		case 's': opts.sparse_files = 1; break;
+		case 'i': opts.inline_files = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	diskname = argv[optind];
+	data_blocks = get_count(argv[optind + 1]);
+
+	if (fs_format(diskname, data_blocks, &opts))
+		die("cannot create virtual disk '%s' (data block count %zu, "
+		    "root directory blocks %zu, journal blocks %zu)", diskname,
+		    data_blocks, opts.root_blocks, opts.journal_blocks);
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", diskname,
+	       data_blocks);
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -34,6 +36,57 @@ struct thread_arg {
 	char **argv;
 };
 
+/* Print the file system statistics before each UMOUNT of a script */
+static int stats_at_umount;
+
+/* Upper bound, in nanoseconds, under which @pct percent of the calls took */
+static uint64_t latency_percentile(const struct fs_op_stats *op, int pct)
+{
+	uint64_t seen = 0;
+	uint64_t want = (op->calls * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < FS_STATS_BUCKETS - 1; i++) {
+		seen += op->latency[i];
+		if (seen >= want)
+			break;
+	}
+	return (uint64_t)2 << i;
+}
+
+void print_stats(void)
+{
+	struct fs_stats stats;
+	int op;
+
+	if (fs_stats(&stats))
+		die("Cannot get statistics");
+
+	printf("%-12s %10s %8s %14s %10s %10s %10s\n", "operation", "calls",
+	       "errors", "bytes", "avg_us", "p50_us<", "p99_us<");
+	for (op = 0; op < FS_OP_COUNT; op++) {
+		const struct fs_op_stats *st = &stats.ops[op];
+
+		if (!st->calls)
+			continue;
+		printf("%-12s %10"PRIu64" %8"PRIu64" %14"PRIu64" %10.2f %10.2f %10.2f\n",
+		       fs_op_name(op), st->calls, st->errors, st->bytes,
+		       st->total_ns / 1000.0 / st->calls,
+		       latency_percentile(st, 50) / 1000.0,
+		       latency_percentile(st, 99) / 1000.0);
+	}
+	printf("block_reads=%"PRIu64"\n", stats.block_reads);
+	printf("block_writes=%"PRIu64"\n", stats.block_writes);
+	printf("read_requests=%"PRIu64"\n", stats.read_requests);
+	printf("write_requests=%"PRIu64"\n", stats.write_requests);
+	printf("disk_syncs=%"PRIu64"\n", stats.disk_syncs);
+	printf("cache_hits=%"PRIu64"\n", stats.cache_hits);
+	printf("cache_misses=%"PRIu64"\n", stats.cache_misses);
+	printf("fat_hops=%"PRIu64"\n", stats.fat_hops);
+	printf("alloc_scans=%"PRIu64"\n", stats.alloc_scans);
+	printf("journal_commits=%"PRIu64"\n", stats.journal_commits);
+}
+
 void thread_fs_script(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -95,6 +148,8 @@ void thread_fs_script(void *arg)
 			}
 
 		} else if (strcmp(command, "UMOUNT") == 0) {
+			if (mounted && stats_at_umount)
+				print_stats();
 			if (mounted && fs_umount())
 				die("Cannot unmount");
 			else {
@@ -102,6 +157,11 @@ void thread_fs_script(void *arg)
 				mounted = 0;
 			}
 
+		} else if (strcmp(command, "STATS") == 0) {
+			if (!mounted)
+				die("STATS needs a mounted file system");
+			print_stats();
+
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
@@ -263,6 +323,8 @@ void thread_fs_script(void *arg)
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
+	if (mounted && stats_at_umount)
+		print_stats();
 	if (mounted && fs_umount())
 		die("Cannot unmount diskname");
 
@@ -467,17 +529,72 @@ void thread_fs_ls(void *arg)
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<dirname>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc < 2) {
+		fs_ls();
+	} else if (fs_ls_dir(t_arg->argv[1])) {
+		fs_umount();
+		die("Cannot list directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
 
 	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (fs_mkdir(dirname)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", dirname);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *dirname;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <dirname>");
+
+	diskname = t_arg->argv[0];
+	dirname = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(dirname)) {
+		fs_umount();
+		die("Cannot remove directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", dirname);
 }
 
 void thread_fs_info(void *arg)
@@ -507,6 +624,277 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_mkjournal(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t blocks;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <blocks>");
+
+	diskname = t_arg->argv[0];
+	blocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mkjournal(diskname, blocks))
+		die("Cannot add journal");
+
+	printf("Added a journal of %zu blocks\n", blocks);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t budget = 64;
+	size_t moved = 0, calls = 0;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("need <diskname> [<budget>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		budget = get_argv(t_arg->argv[1]);
+	if (!budget)
+		die("budget must be positive");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Small steps, as a background task sharing the volume would take */
+	while ((ret = fs_defrag(budget)) > 0) {
+		moved += ret;
+		calls++;
+	}
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Moved %zu blocks in %zu steps of at most %zu\n", moved, calls,
+	       budget);
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <scriptname>");
+
+	stats_at_umount = 1;
+	thread_fs_script(arg);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Collect the completed asynchronous requests, all of them if @wait_all */
+static void replay_reap(int wait_all)
+{
+	struct fs_completion events[FS_OPEN_MAX_COUNT];
+	int max = ARRAY_SIZE(events);
+	int n;
+
+	do
+		n = fs_aio_wait(events, wait_all ? max : 0, max);
+	while (n > 0 && (wait_all || n == max));
+}
+
+/* Carry out one recorded call; returns what the call returned */
+static int replay_call(const struct fs_trace_record *rec, const char *path,
+		       int *fds, char *buf)
+{
+	int fd = rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT ? fds[rec->fd] : -1;
+	int ret;
+
+	switch (rec->op) {
+	case FS_OP_CREATE:
+		return fs_create(path);
+	case FS_OP_DELETE:
+		return fs_delete(path);
+	case FS_OP_MKDIR:
+		return fs_mkdir(path);
+	case FS_OP_RMDIR:
+		return fs_rmdir(path);
+	case FS_OP_OPEN:
+		ret = fs_open(path);
+		if (ret >= 0 && rec->result >= 0 && rec->result < FS_OPEN_MAX_COUNT)
+			fds[rec->result] = ret;
+		return ret;
+	case FS_OP_CLOSE:
+		ret = fs_close(fd);
+		if (!ret)
+			fds[rec->fd] = -1;
+		return ret;
+	case FS_OP_STAT:
+		return fs_stat(fd);
+	case FS_OP_LSEEK:
+		return fs_lseek(fd, rec->offset);
+	case FS_OP_READ:
+	case FS_OP_READ_VIEW:	/* the replay does not map the disk */
+		return fs_read(fd, buf, rec->size);
+	case FS_OP_WRITE:
+		return fs_write(fd, buf, rec->size);
+	case FS_OP_FALLOCATE:
+		return fs_fallocate(fd, rec->size);
+	case FS_OP_FSYNC:
+		return fs_fsync(fd);
+	case FS_OP_SYNC:
+		return fs_sync();
+	case FS_OP_FLUSH:
+		return fs_flush();
+	case FS_OP_ADVISE:
+		return fs_advise(fd, rec->size);
+	case FS_OP_READ_ASYNC:
+		ret = fs_read_async(fd, buf, rec->size, NULL);
+		replay_reap(0);
+		return ret;
+	case FS_OP_WRITE_ASYNC:
+		ret = fs_write_async(fd, buf, rec->size, NULL);
+		replay_reap(0);
+		return ret;
+	}
+	return -1;
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *tracename;
+	int paced;
+	int fd, i;
+	struct stat st;
+	const uint8_t *trace;
+	const struct fs_trace_header *header;
+	size_t pos, max_size = 0, records = 0, diverged = 0;
+	uint64_t calls[FS_OP_COUNT] = {0}, recorded_ns[FS_OP_COUNT] = {0};
+	uint64_t bytes = 0, start, elapsed;
+	int fds[FS_OPEN_MAX_COUNT];
+	char *buf;
+	struct fs_stats stats;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <tracefile> [paced]");
+
+	diskname = t_arg->argv[0];
+	tracename = t_arg->argv[1];
+	paced = t_arg->argc > 2 && !strcmp(t_arg->argv[2], "paced");
+
+	fd = open(tracename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size < sizeof(*header))
+		die("Not a trace file");
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	header = (const void *)trace;
+	if (header->magic != FS_TRACE_MAGIC || header->version != FS_TRACE_VERSION)
+		die("Not a trace file");
+
+	/* First pass: validate the records and size the data buffer */
+	for (pos = sizeof(*header); pos < (size_t)st.st_size;) {
+		struct fs_trace_record rec;
+
+		if (pos + sizeof(rec) > (size_t)st.st_size)
+			die("Truncated trace file");
+		memcpy(&rec, trace + pos, sizeof(rec));
+		pos += sizeof(rec) + rec.path_len;
+		if (pos > (size_t)st.st_size || rec.op >= FS_OP_COUNT)
+			die("Corrupted trace file");
+		if (rec.size > max_size && rec.op != FS_OP_FALLOCATE &&
+		    rec.op != FS_OP_ADVISE)
+			max_size = rec.size;
+		calls[rec.op]++;
+		recorded_ns[rec.op] += rec.duration_ns;
+		records++;
+	}
+
+	buf = malloc(max_size ? max_size : 1);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'r', max_size);
+	for (i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	start = now_ns();
+	for (pos = sizeof(*header); pos < (size_t)st.st_size;) {
+		struct fs_trace_record rec;
+		char path[UINT8_MAX + 1];
+		int ret;
+
+		memcpy(&rec, trace + pos, sizeof(rec));
+		pos += sizeof(rec);
+		memcpy(path, trace + pos, rec.path_len);
+		path[rec.path_len] = '\0';
+		pos += rec.path_len;
+
+		if (paced) {
+			uint64_t due = start + rec.time_ns;
+			struct timespec ts = {
+				.tv_sec = due / 1000000000u,
+				.tv_nsec = due % 1000000000u,
+			};
+
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		ret = replay_call(&rec, path, fds, buf);
+		if ((ret < 0) != (rec.result < 0))
+			diverged++;
+		if (ret > 0 && (rec.op == FS_OP_READ || rec.op == FS_OP_WRITE ||
+				rec.op == FS_OP_READ_VIEW))
+			bytes += ret;
+	}
+	replay_reap(1);
+	elapsed = now_ns() - start;
+
+	if (fs_stats(&stats))
+		die("Cannot get statistics");
+	for (i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		if (fds[i] >= 0)
+			fs_close(fds[i]);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Replayed %zu calls in %.3f s (%s): %.0f calls/s, %.2f MB/s\n",
+	       records, elapsed / 1e9, paced ? "paced" : "as fast as possible",
+	       records / (elapsed / 1e9), bytes / (elapsed / 1e3));
+	printf("%zu calls succeeded or failed differently than recorded\n",
+	       diverged);
+	printf("%-12s %10s %14s %14s\n", "operation", "calls", "recorded_us",
+	       "replayed_us");
+	for (i = 0; i < FS_OP_COUNT; i++) {
+		const struct fs_op_stats *op = &stats.ops[i];
+
+		if (!calls[i])
+			continue;
+		printf("%-12s %10"PRIu64" %14.2f %14.2f\n", fs_op_name(i),
+		       calls[i], recorded_ns[i] / 1000.0 / calls[i],
+		       op->calls ? op->total_ns / 1000.0 / op->calls : 0.0);
+	}
+
+	free(buf);
+	munmap((void *)trace, st.st_size);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -517,6 +905,12 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
+	{ "mkjournal",	thread_fs_mkjournal },
+	{ "defrag",	thread_fs_defrag },
+	{ "stats",	thread_fs_stats },
+	{ "replay",	thread_fs_replay },
 	{ "script",	thread_fs_script }
 };
 
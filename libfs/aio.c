@@ -0,0 +1,525 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aio.h"
+
+/* Size of the worker pool used without io_uring */
+#define AIO_THREADS 4
+
+/* user_data of the no-op used to wake up the reaper thread */
+#define AIO_WAKEUP 0
+
+/* Interval at which the reaper polls completions once io_uring_enter fails */
+#define AIO_POLL_NS 1000000
+
+struct aio_op {
+	bool write;
+	uint8_t *buf;
+	size_t len;
+	off_t off;
+	/* Bytes transferred so far (short transfers are resumed) */
+	size_t done_len;
+	/* Result reported by the kernel, until the callback runs */
+	long res;
+	struct iovec iov;
+	aio_done_fn done;
+	void *arg;
+	struct aio_op *next;
+};
+
+struct aio_queue {
+	int fd;
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	/* Signalled when operations are queued or complete */
+	pthread_cond_t cond;
+	/* Operations not handed to the kernel (or a worker) yet */
+	struct aio_op *head, *tail;
+	/* Operations queued and not completed yet */
+	size_t pending;
+	bool stopping;
+	int nthreads;
+	/* The reaper (with io_uring) then the workers */
+	pthread_t threads[AIO_THREADS + 1];
+
+	/* io_uring (ring_fd is -1 with the worker pool) */
+	int ring_fd;
+	/* io_uring_enter failed: new operations go to the worker pool, and the
+	 * reaper only collects those left in the kernel */
+	bool ring_failed;
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+	unsigned *cq_head, *cq_tail, cq_mask, cq_entries;
+	struct io_uring_cqe *cqes;
+	/* Operations currently in the kernel, kept below cq_entries so that
+	 * completions can never overflow */
+	size_t in_ring;
+	/* Of those, the ones io_uring_enter took (the reaper waits for them) */
+	size_t in_kernel;
+};
+
+static void pushOp(struct aio_queue *q, struct aio_op *op, bool front)
+{
+	if (front) {
+		op->next = q->head;
+		q->head = op;
+		if (!q->tail)
+			q->tail = op;
+		return;
+	}
+	op->next = NULL;
+	if (q->tail)
+		q->tail->next = op;
+	else
+		q->head = op;
+	q->tail = op;
+}
+
+static struct aio_op *popOp(struct aio_queue *q)
+{
+	struct aio_op *op = q->head;
+
+	if (op) {
+		q->head = op->next;
+		if (!q->head)
+			q->tail = NULL;
+	}
+	return op;
+}
+
+/* Called without the lock held */
+static void completeOp(struct aio_queue *q, struct aio_op *op, long res)
+{
+	op->done(op->arg, res);
+	free(op);
+
+	pthread_mutex_lock(&q->lock);
+	q->pending--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Worker pool
+ */
+
+static void *workerMain(void *data)
+{
+	struct aio_queue *q = data;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (!q->head && !q->stopping)
+			pthread_cond_wait(&q->cond, &q->lock);
+		struct aio_op *op = popOp(q);
+		pthread_mutex_unlock(&q->lock);
+		if (!op)
+			return NULL;
+
+		long res = 0;
+		while (op->done_len < op->len) {
+			ssize_t ret;
+			if (op->write)
+				ret = pwrite(q->fd, op->buf + op->done_len,
+					     op->len - op->done_len,
+					     op->off + op->done_len);
+			else
+				ret = pread(q->fd, op->buf + op->done_len,
+					    op->len - op->done_len,
+					    op->off + op->done_len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0) {
+				res = ret < 0 ? -errno : -EIO;
+				break;
+			}
+			op->done_len += ret;
+		}
+		completeOp(q, op, res < 0 ? res : (long)op->len);
+	}
+}
+
+/* Start workers up to the size of the pool; returns the number running */
+static int startWorkers(struct aio_queue *q)
+{
+	int workers = q->nthreads - (q->ring_fd >= 0);
+
+	while (workers < AIO_THREADS &&
+	       pthread_create(&q->threads[q->nthreads], NULL, workerMain, q) == 0) {
+		q->nthreads++;
+		workers++;
+	}
+	return workers;
+}
+
+/* Whether operations go to io_uring rather than to the worker pool */
+static bool ringActive(const struct aio_queue *q)
+{
+	return q->ring_fd >= 0 && !q->ring_failed;
+}
+
+/*
+ * io_uring
+ */
+
+static int ringEnter(struct aio_queue *q, unsigned to_submit,
+		     unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, q->ring_fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+/* Fill an SQE; the caller makes sure there is room */
+static void ringPrep(struct aio_queue *q, uint8_t opcode, struct aio_op *op)
+{
+	unsigned tail = *q->sq_tail;
+	unsigned idx = tail & q->sq_mask;
+	struct io_uring_sqe *sqe = &q->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = q->fd;
+	if (op) {
+		op->iov.iov_base = op->buf + op->done_len;
+		op->iov.iov_len = op->len - op->done_len;
+		sqe->addr = (uintptr_t)&op->iov;
+		sqe->len = 1;
+		sqe->off = op->off + op->done_len;
+		sqe->user_data = (uintptr_t)op;
+	} else {
+		sqe->user_data = AIO_WAKEUP;
+	}
+	q->sq_array[idx] = idx;
+	__atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Give up io_uring after io_uring_enter failed: the entries the kernel did not
+ * take are taken back from the ring, and their operations, like every later
+ * one, go to the worker pool. The reaper joins the pool once the operations
+ * the kernel took are done.
+ */
+static void ringFailLocked(struct aio_queue *q)
+{
+	unsigned head = __atomic_load_n(q->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *q->sq_tail;
+
+	while (tail != head) {
+		tail--;
+		struct io_uring_sqe *sqe = &q->sqes[q->sq_array[tail & q->sq_mask]];
+		struct aio_op *op = (struct aio_op *)(uintptr_t)sqe->user_data;
+
+		q->in_ring--;
+		if (op)
+			pushOp(q, op, true);
+	}
+	__atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+	q->ring_failed = true;
+	startWorkers(q);
+	pthread_cond_broadcast(&q->cond);
+}
+
+/* Hand the last n entries of the ring to the kernel */
+static void ringFlushLocked(struct aio_queue *q, unsigned n)
+{
+	while (n > 0) {
+		int ret = ringEnter(q, n, 0, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			ringFailLocked(q);
+			return;
+		}
+		if (ret > 0) {
+			if (q->in_kernel == 0)	/* the reaper waits for these */
+				pthread_cond_broadcast(&q->cond);
+			q->in_kernel += ret;
+			n -= ret;
+		}
+	}
+}
+
+/* Move queued operations into the ring, as far as room allows */
+static void ringSubmitLocked(struct aio_queue *q)
+{
+	unsigned n = 0;
+
+	while (ringActive(q) && q->head && n < q->sq_entries &&
+	       q->in_ring < q->cq_entries) {
+		struct aio_op *op = popOp(q);
+		ringPrep(q, op->write ? IORING_OP_WRITEV : IORING_OP_READV, op);
+		q->in_ring++;
+		n++;
+	}
+	ringFlushLocked(q, n);
+}
+
+static void *reaperMain(void *data)
+{
+	struct aio_queue *q = data;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (q->in_kernel == 0 && !q->ring_failed)
+			pthread_cond_wait(&q->cond, &q->lock);
+		/* Once the ring failed, completions are polled for */
+		bool polling = q->ring_failed;
+		bool work = polling && q->in_kernel == 0;
+		pthread_mutex_unlock(&q->lock);
+		if (work)	/* nothing left in the kernel */
+			return workerMain(q);
+
+		if (polling) {
+			struct timespec pause = { 0, AIO_POLL_NS };
+			nanosleep(&pause, NULL);
+		} else if (ringEnter(q, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+			   errno != EINTR) {
+			pthread_mutex_lock(&q->lock);
+			ringFailLocked(q);
+			pthread_mutex_unlock(&q->lock);
+		}
+
+		struct aio_op *finished = NULL;
+		bool wakeup = false;
+
+		pthread_mutex_lock(&q->lock);
+		unsigned head = *q->cq_head;
+		unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &q->cqes[head & q->cq_mask];
+			struct aio_op *op = (struct aio_op *)(uintptr_t)cqe->user_data;
+
+			q->in_ring--;
+			q->in_kernel--;
+			if (!op) {
+				wakeup = true;
+				continue;
+			}
+			if (cqe->res > 0 && op->done_len + cqe->res < op->len) {
+				/* Short transfer: resume where it stopped */
+				op->done_len += cqe->res;
+				pushOp(q, op, true);
+				continue;
+			}
+			if (cqe->res > 0)
+				op->done_len += cqe->res;
+			op->res = cqe->res;
+			op->next = finished;
+			finished = op;
+		}
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+		ringSubmitLocked(q);
+		if (q->ring_failed)	/* resumed transfers go to the workers */
+			pthread_cond_broadcast(&q->cond);
+		bool stop = wakeup && q->stopping;
+		pthread_mutex_unlock(&q->lock);
+
+		while (finished) {
+			struct aio_op *op = finished;
+			finished = op->next;
+			if (op->res >= 0)
+				op->res = op->res == 0 ? -EIO : (long)op->len;
+			completeOp(q, op, op->res);
+		}
+		if (stop)
+			return NULL;
+	}
+}
+
+static int ringSetup(struct aio_queue *q, unsigned int depth)
+{
+#ifdef __NR_io_uring_setup
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	q->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (q->ring_fd < 0)
+		return -1;
+
+	q->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single) {
+		if (q->cq_map_len > q->sq_map_len)
+			q->sq_map_len = q->cq_map_len;
+		q->cq_map_len = q->sq_map_len;
+	}
+
+	q->sq_map = mmap(NULL, q->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQ_RING);
+	if (q->sq_map == MAP_FAILED)
+		goto err_close;
+	if (single) {
+		q->cq_map = q->sq_map;
+	} else {
+		q->cq_map = mmap(NULL, q->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, q->ring_fd,
+				 IORING_OFF_CQ_RING);
+		if (q->cq_map == MAP_FAILED)
+			goto err_sq;
+	}
+	q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+	if (q->sqes == MAP_FAILED)
+		goto err_cq;
+
+	uint8_t *sq = q->sq_map, *cq = q->cq_map;
+	q->sq_head = (unsigned *)(sq + p.sq_off.head);
+	q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	q->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	q->sq_entries = p.sq_entries;
+	q->sq_array = (unsigned *)(sq + p.sq_off.array);
+	q->cq_head = (unsigned *)(cq + p.cq_off.head);
+	q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	q->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	q->cq_entries = p.cq_entries;
+	q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+err_cq:
+	if (!single)
+		munmap(q->cq_map, q->cq_map_len);
+err_sq:
+	munmap(q->sq_map, q->sq_map_len);
+err_close:
+	close(q->ring_fd);
+	q->ring_fd = -1;
+	return -1;
+#else
+	(void)depth;
+	q->ring_fd = -1;
+	return -1;
+#endif
+}
+
+static void ringTeardown(struct aio_queue *q)
+{
+	munmap(q->sqes, q->sqes_len);
+	if (q->cq_map != q->sq_map)
+		munmap(q->cq_map, q->cq_map_len);
+	munmap(q->sq_map, q->sq_map_len);
+	close(q->ring_fd);
+}
+
+struct aio_queue *aio_create(int fd, unsigned int depth, int threads_only)
+{
+	struct aio_queue *q = calloc(1, sizeof(*q));
+	if (!q)
+		return NULL;
+
+	q->fd = fd;
+	q->ring_fd = -1;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	if (!threads_only && ringSetup(q, depth) == 0) {
+		if (pthread_create(&q->threads[0], NULL, reaperMain, q) == 0) {
+			q->nthreads = 1;
+			return q;
+		}
+		ringTeardown(q);
+		q->ring_fd = -1;
+	}
+
+	if (startWorkers(q) == 0) {
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+void aio_destroy(struct aio_queue *q)
+{
+	aio_drain(q);
+
+	pthread_mutex_lock(&q->lock);
+	q->stopping = true;
+	if (ringActive(q)) {
+		/* The reaper sleeps until a completion comes */
+		ringPrep(q, IORING_OP_NOP, NULL);
+		q->in_ring++;
+		ringFlushLocked(q, 1);
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	for (int i = 0; i < q->nthreads; i++)
+		pthread_join(q->threads[i], NULL);
+	if (q->ring_fd >= 0)
+		ringTeardown(q);
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+int aio_uses_uring(const struct aio_queue *q)
+{
+	return ringActive(q);
+}
+
+static int queueOp(struct aio_queue *q, bool write, void *buf, size_t len,
+		   off_t off, aio_done_fn done, void *arg)
+{
+	struct aio_op *op = calloc(1, sizeof(*op));
+	if (!op)
+		return -1;
+
+	op->write = write;
+	op->buf = buf;
+	op->len = len;
+	op->off = off;
+	op->done = done;
+	op->arg = arg;
+
+	pthread_mutex_lock(&q->lock);
+	pushOp(q, op, false);
+	q->pending++;
+	if (!ringActive(q))
+		pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+int aio_read(struct aio_queue *q, void *buf, size_t len, off_t off,
+	     aio_done_fn done, void *arg)
+{
+	return queueOp(q, false, buf, len, off, done, arg);
+}
+
+int aio_write(struct aio_queue *q, const void *buf, size_t len, off_t off,
+	      aio_done_fn done, void *arg)
+{
+	return queueOp(q, true, (void *)buf, len, off, done, arg);
+}
+
+void aio_submit(struct aio_queue *q)
+{
+	/* Workers pick up operations as soon as they are queued */
+	pthread_mutex_lock(&q->lock);
+	ringSubmitLocked(q);
+	pthread_mutex_unlock(&q->lock);
+}
+
+void aio_drain(struct aio_queue *q)
+{
+	aio_submit(q);
+
+	pthread_mutex_lock(&q->lock);
+	while (q->pending > 0)
+		pthread_cond_wait(&q->cond, &q->lock);
+	pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,98 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <stddef.h> /* for size_t definition */
+#include <sys/types.h> /* for off_t definition */
+
+/**
+ * aio_done_fn - Completion callback
+ * @arg: Argument given when the operation was queued
+ * @res: Number of bytes transferred (the whole length), or a negative errno
+ *
+ * Called once per operation, from a thread internal to the queue. It must not
+ * block for long, nor queue new operations on the same queue.
+ */
+typedef void (*aio_done_fn)(void *arg, long res);
+
+/** Opaque asynchronous I/O queue */
+struct aio_queue;
+
+/**
+ * aio_create - Create an asynchronous I/O queue on a file
+ * @fd: File descriptor, which must stay open until aio_destroy()
+ * @depth: Number of operations handed to the kernel at once
+ * @threads_only: Do not try io_uring
+ *
+ * Operations are carried out through io_uring, with one thread reaping
+ * completions. Where io_uring is not available (or with @threads_only), a
+ * small pool of worker threads performs them with pread(2) and pwrite(2)
+ * instead. If io_uring_enter(2) fails later on, the queue moves to the worker
+ * pool for good, with the operations the kernel did not take.
+ *
+ * Return: NULL if the queue cannot be set up. The new queue otherwise.
+ */
+struct aio_queue *aio_create(int fd, unsigned int depth, int threads_only);
+
+/**
+ * aio_destroy - Wait for queued operations and release a queue
+ * @q: Asynchronous I/O queue
+ */
+void aio_destroy(struct aio_queue *q);
+
+/**
+ * aio_uses_uring - Tell whether a queue is backed by io_uring
+ * @q: Asynchronous I/O queue
+ *
+ * Return: 0 with the worker pool, including after io_uring failed.
+ */
+int aio_uses_uring(const struct aio_queue *q);
+
+/**
+ * aio_read - Queue a read
+ * @q: Asynchronous I/O queue
+ * @buf: Buffer to fill, which must stay valid until completion
+ * @len: Number of bytes to read
+ * @off: File offset to read from
+ * @done: Completion callback
+ * @arg: Argument passed to @done
+ *
+ * The read may only start at the next aio_submit().
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int aio_read(struct aio_queue *q, void *buf, size_t len, off_t off,
+	     aio_done_fn done, void *arg);
+
+/**
+ * aio_write - Queue a write
+ * @q: Asynchronous I/O queue
+ * @buf: Data to write, which must stay valid until completion
+ * @len: Number of bytes to write
+ * @off: File offset to write at
+ * @done: Completion callback
+ * @arg: Argument passed to @done
+ *
+ * Return: -1 if memory cannot be allocated. 0 otherwise.
+ */
+int aio_write(struct aio_queue *q, const void *buf, size_t len, off_t off,
+	      aio_done_fn done, void *arg);
+
+/**
+ * aio_submit - Start the queued operations
+ * @q: Asynchronous I/O queue
+ *
+ * Hand every operation queued so far to the kernel (or to the worker threads)
+ * in one go. Operations beyond what the kernel accepts at once are started as
+ * earlier ones complete.
+ */
+void aio_submit(struct aio_queue *q);
+
+/**
+ * aio_drain - Wait for every queued operation to complete
+ * @q: Asynchronous I/O queue
+ *
+ * Also submits operations that were queued but not submitted yet.
+ */
+void aio_drain(struct aio_queue *q);
+
+#endif /* _AIO_H */
@@ -0,0 +1,606 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+/* Marks the end of a hash chain or an empty bucket */
+#define NO_ENTRY -1
+
+/* Cached copy of one disk block */
+struct cache_entry {
+	/* Disk block index held by this entry */
+	size_t block;
+	/* Entry currently holds a block */
+	bool valid;
+	/* Block was modified since it was last written to disk */
+	bool dirty;
+	/* Neighbours in the LRU list (most recently used first) */
+	int prev, next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+	/* Block content */
+	uint8_t *data;
+};
+
+/* Dirty entry waiting to be written back */
+struct dirty_slot {
+	size_t block;
+	int entry;
+};
+
+struct block_cache {
+	/* Disk the cached blocks belong to */
+	struct disk *disk;
+	/* Number of entries */
+	size_t nblocks;
+	struct cache_entry *entries;
+	/* LRU list ends */
+	int head, tail;
+	/* Hash buckets (power of two) */
+	int *buckets;
+	size_t nbuckets;
+	/* Backing memory for all entries */
+	uint8_t *mem;
+	/* Protects everything in the cache, including the entries' data */
+	pthread_mutex_t lock;
+	/* Scratch arrays used to write back dirty blocks in runs */
+	struct dirty_slot *order;
+	const void **bufs;
+	/* Bumped by every write to disk, so a prefetch that raced with one is
+	 * dropped instead of caching data it may have read before the write */
+	unsigned long writes;
+	/* Lookups that found their block cached, and those that did not */
+	unsigned long hits, misses;
+};
+
+/* Blocks read ahead by cache_prefetch(), waiting to be cached */
+struct prefetch {
+	struct block_cache *cache;
+	size_t block;
+	size_t count;
+	unsigned long writes;
+	uint8_t data[];
+};
+
+static size_t hashBlock(struct block_cache *cache, size_t block)
+{
+	return (block * 2654435761u) & (cache->nbuckets - 1);
+}
+
+static int lookup(struct block_cache *cache, size_t block)
+{
+	int i = cache->buckets[hashBlock(cache, block)];
+	while (i != NO_ENTRY && cache->entries[i].block != block)
+		i = cache->entries[i].hnext;
+	return i;
+}
+
+static void lruUnlink(struct block_cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	if (e->prev != NO_ENTRY)
+		cache->entries[e->prev].next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next != NO_ENTRY)
+		cache->entries[e->next].prev = e->prev;
+	else
+		cache->tail = e->prev;
+}
+
+static void lruPushFront(struct block_cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	e->prev = NO_ENTRY;
+	e->next = cache->head;
+	if (cache->head != NO_ENTRY)
+		cache->entries[cache->head].prev = i;
+	cache->head = i;
+	if (cache->tail == NO_ENTRY)
+		cache->tail = i;
+}
+
+static void lruPushBack(struct block_cache *cache, int i)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	e->next = NO_ENTRY;
+	e->prev = cache->tail;
+	if (cache->tail != NO_ENTRY)
+		cache->entries[cache->tail].next = i;
+	cache->tail = i;
+	if (cache->head == NO_ENTRY)
+		cache->head = i;
+}
+
+static void hashRemove(struct block_cache *cache, int i)
+{
+	int *link = &cache->buckets[hashBlock(cache, cache->entries[i].block)];
+	while (*link != i)
+		link = &cache->entries[*link].hnext;
+	*link = cache->entries[i].hnext;
+}
+
+static int writeBack(struct block_cache *cache, struct cache_entry *e)
+{
+	if (e->valid && e->dirty) {
+		cache->writes++;
+		if (disk_write(cache->disk, e->block, e->data) == -1)
+			return -1;
+		e->dirty = false;
+	}
+	return 0;
+}
+
+/* Make entry @i, which is not in use, hold @block as the most recent one */
+static void claimEntry(struct block_cache *cache, int i, size_t block)
+{
+	struct cache_entry *e = &cache->entries[i];
+
+	e->block = block;
+	e->valid = true;
+	e->dirty = false;
+	size_t h = hashBlock(cache, block);
+	e->hnext = cache->buckets[h];
+	cache->buckets[h] = i;
+
+	lruUnlink(cache, i);
+	lruPushFront(cache, i);
+}
+
+/*
+ * Return the entry holding @block, loading it from disk if @load is set.
+ * The entry becomes the most recently used one.
+ */
+static int getEntry(struct block_cache *cache, size_t block, bool load)
+{
+	int i = lookup(cache, block);
+
+	if (i != NO_ENTRY) {
+		cache->hits++;
+		lruUnlink(cache, i);
+		lruPushFront(cache, i);
+		return i;
+	}
+	cache->misses++;
+
+	/* Recycle the least recently used entry */
+	i = cache->tail;
+	struct cache_entry *e = &cache->entries[i];
+	if (writeBack(cache, e) == -1)
+		return NO_ENTRY;
+	if (e->valid)
+		hashRemove(cache, i);
+	e->valid = false;
+
+	if (load && disk_read(cache->disk, block, e->data) == -1)
+		return NO_ENTRY;
+
+	claimEntry(cache, i, block);
+	return i;
+}
+
+struct block_cache *cache_create(struct disk *disk, size_t nblocks)
+{
+	struct block_cache *cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->disk = disk;
+	cache->nblocks = nblocks;
+	cache->head = cache->tail = NO_ENTRY;
+	pthread_mutex_init(&cache->lock, NULL);
+	if (nblocks == 0)
+		return cache;
+
+	cache->nbuckets = 1;
+	while (cache->nbuckets < 2 * nblocks)
+		cache->nbuckets <<= 1;
+
+	cache->entries = calloc(nblocks, sizeof(*cache->entries));
+	cache->buckets = malloc(cache->nbuckets * sizeof(*cache->buckets));
+	cache->mem = malloc(nblocks * BLOCK_SIZE);
+	cache->order = malloc(nblocks * sizeof(*cache->order));
+	cache->bufs = malloc(nblocks * sizeof(*cache->bufs));
+	if (!cache->entries || !cache->buckets || !cache->mem ||
+	    !cache->order || !cache->bufs) {
+		free(cache->entries);
+		free(cache->buckets);
+		free(cache->mem);
+		free(cache->order);
+		free(cache->bufs);
+		pthread_mutex_destroy(&cache->lock);
+		free(cache);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < cache->nbuckets; i++)
+		cache->buckets[i] = NO_ENTRY;
+	for (size_t i = 0; i < nblocks; i++) {
+		cache->entries[i].data = &cache->mem[i * BLOCK_SIZE];
+		lruPushFront(cache, i);
+	}
+
+	return cache;
+}
+
+static int cmpBlock(const void *a, const void *b)
+{
+	size_t x = ((const struct dirty_slot *)a)->block;
+	size_t y = ((const struct dirty_slot *)b)->block;
+	return (x > y) - (x < y);
+}
+
+/* Dirty blocks are sorted so that consecutive ones go out in one request */
+static int flushLocked(struct block_cache *cache)
+{
+	struct dirty_slot *order = cache->order;
+	size_t ndirty = 0;
+	for (size_t i = 0; i < cache->nblocks; i++) {
+		if (cache->entries[i].valid && cache->entries[i].dirty) {
+			order[ndirty].block = cache->entries[i].block;
+			order[ndirty].entry = i;
+			ndirty++;
+		}
+	}
+	if (ndirty == 0)	/* always the case without cache blocks (no order) */
+		return 0;
+
+	qsort(order, ndirty, sizeof(*order), cmpBlock);
+	cache->writes++;
+
+	int ret = 0;
+	size_t start = 0;
+	while (start < ndirty) {
+		size_t end = start + 1;
+		while (end < ndirty && order[end].block == order[start].block + (end - start))
+			end++;
+
+		for (size_t i = start; i < end; i++)
+			cache->bufs[i - start] = cache->entries[order[i].entry].data;
+		if (disk_writev(cache->disk, order[start].block, cache->bufs,
+				end - start) == -1) {
+			ret = -1;
+		} else {
+			for (size_t i = start; i < end; i++)
+				cache->entries[order[i].entry].dirty = false;
+		}
+		start = end;
+	}
+	return ret;
+}
+
+int cache_flush(struct block_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	int ret = flushLocked(cache);
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_flush_block(struct block_cache *cache, size_t block)
+{
+	if (cache->nblocks == 0)
+		return 0;
+
+	pthread_mutex_lock(&cache->lock);
+	int i = lookup(cache, block);
+	int ret = i == NO_ENTRY ? 0 : writeBack(cache, &cache->entries[i]);
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_destroy(struct block_cache *cache)
+{
+	int ret = cache_flush(cache);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->entries);
+	free(cache->buckets);
+	free(cache->mem);
+	free(cache->order);
+	free(cache->bufs);
+	free(cache);
+	return ret;
+}
+
+int cache_read(struct block_cache *cache, size_t block, size_t offset,
+	       size_t len, void *buf)
+{
+	if (cache->nblocks == 0) {
+		uint8_t bounce_buf[BLOCK_SIZE];
+		if (disk_read(cache->disk, block, bounce_buf) == -1)
+			return -1;
+		memcpy(buf, &bounce_buf[offset], len);
+		return 0;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int i = getEntry(cache, block, true);
+	if (i != NO_ENTRY)
+		memcpy(buf, &cache->entries[i].data[offset], len);
+	pthread_mutex_unlock(&cache->lock);
+	return i == NO_ENTRY ? -1 : 0;
+}
+
+int cache_read_through(struct block_cache *cache, size_t block, void *buf)
+{
+	if (cache->nblocks == 0)
+		return disk_read(cache->disk, block, buf);
+
+	pthread_mutex_lock(&cache->lock);
+	int i = lookup(cache, block);
+	if (i != NO_ENTRY) {
+		cache->hits++;
+		lruUnlink(cache, i);
+		lruPushFront(cache, i);
+		memcpy(buf, cache->entries[i].data, BLOCK_SIZE);
+	} else {
+		cache->misses++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Misses are read without holding the lock, so they run in parallel */
+	if (i == NO_ENTRY)
+		return disk_read(cache->disk, block, buf);
+	return 0;
+}
+
+/*
+ * Copy @len bytes of @buf into the cached block @block at @offset. Unless
+ * @keep is set, the block is not read from disk and is zeroed if not cached.
+ */
+static int putLocked(struct block_cache *cache, size_t block, size_t offset,
+		     size_t len, const void *buf, bool keep)
+{
+	bool full = offset == 0 && len == BLOCK_SIZE;
+	bool cached = lookup(cache, block) != NO_ENTRY;
+
+	int i = getEntry(cache, block, keep && !full);
+	if (i == NO_ENTRY)
+		return -1;
+	if (!keep && !full && !cached)
+		memset(cache->entries[i].data, 0, BLOCK_SIZE);
+	memcpy(&cache->entries[i].data[offset], buf, len);
+	cache->entries[i].dirty = true;
+	return 0;
+}
+
+int cache_write(struct block_cache *cache, size_t block, size_t offset,
+		size_t len, const void *buf)
+{
+	if (cache->nblocks == 0) {
+		uint8_t bounce_buf[BLOCK_SIZE];
+		if (offset == 0 && len == BLOCK_SIZE)
+			return disk_write(cache->disk, block, buf);
+		if (disk_read(cache->disk, block, bounce_buf) == -1)
+			return -1;
+		memcpy(&bounce_buf[offset], buf, len);
+		return disk_write(cache->disk, block, bounce_buf);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int ret = putLocked(cache, block, offset, len, buf, true);
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_overwrite(struct block_cache *cache, size_t block, size_t offset,
+		    size_t len, const void *buf)
+{
+	if (cache->nblocks == 0) {
+		uint8_t bounce_buf[BLOCK_SIZE] = { 0 };
+		if (offset == 0 && len == BLOCK_SIZE)
+			return disk_write(cache->disk, block, buf);
+		memcpy(&bounce_buf[offset], buf, len);
+		return disk_write(cache->disk, block, bounce_buf);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	int ret = putLocked(cache, block, offset, len, buf, false);
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_read_range(struct block_cache *cache, size_t block, size_t count,
+		     void *buf)
+{
+	if (cache->nblocks == 0)
+		return disk_read_range(cache->disk, block, count, buf);
+
+	/* Leading blocks that are cached (e.g. read ahead) are copied from it */
+	pthread_mutex_lock(&cache->lock);
+	int i;
+	while (count > 0 && (i = lookup(cache, block)) != NO_ENTRY) {
+		memcpy(buf, cache->entries[i].data, BLOCK_SIZE);
+		buf = (uint8_t *)buf + BLOCK_SIZE;
+		block++;
+		count--;
+		cache->hits++;
+	}
+	cache->misses += count;
+	pthread_mutex_unlock(&cache->lock);
+	if (count == 0)
+		return 0;
+
+	if (disk_read_range(cache->disk, block, count, buf) == -1)
+		return -1;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t n = 0; n < count; n++) {
+		int i = lookup(cache, block + n);
+		if (i != NO_ENTRY && cache->entries[i].dirty)
+			memcpy((uint8_t *)buf + n * BLOCK_SIZE,
+			       cache->entries[i].data, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+int cache_write_range(struct block_cache *cache, size_t block, size_t count,
+		      const void *buf)
+{
+	if (cache->nblocks == 0)
+		return disk_write_range(cache->disk, block, count, buf);
+
+	/* Held across the write so a concurrent flush cannot write back an older
+	 * copy of these blocks afterwards */
+	pthread_mutex_lock(&cache->lock);
+	cache->writes++;
+	int ret = disk_write_range(cache->disk, block, count, buf);
+	for (size_t n = 0; ret == 0 && n < count; n++) {
+		int i = lookup(cache, block + n);
+		if (i != NO_ENTRY) {
+			memcpy(cache->entries[i].data,
+			       (const uint8_t *)buf + n * BLOCK_SIZE, BLOCK_SIZE);
+			cache->entries[i].dirty = false;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+int cache_flush_range(struct block_cache *cache, size_t block, size_t count)
+{
+	if (cache->nblocks == 0)
+		return 0;
+
+	int ret = 0;
+	pthread_mutex_lock(&cache->lock);
+	for (size_t n = 0; n < count; n++) {
+		int i = lookup(cache, block + n);
+		if (i != NO_ENTRY && writeBack(cache, &cache->entries[i]) == -1)
+			ret = -1;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+void cache_update_range(struct block_cache *cache, size_t block, size_t count,
+			const void *buf)
+{
+	if (cache->nblocks == 0)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->writes++;
+	for (size_t n = 0; n < count; n++) {
+		int i = lookup(cache, block + n);
+		if (i != NO_ENTRY) {
+			memcpy(cache->entries[i].data,
+			       (const uint8_t *)buf + n * BLOCK_SIZE, BLOCK_SIZE);
+			cache->entries[i].dirty = false;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_note_write(struct block_cache *cache)
+{
+	if (cache->nblocks == 0)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->writes++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Cache the blocks that were read ahead, unless a write may have made them
+ * stale. Only entries that are free or clean are recycled, so that this never
+ * writes to disk from the completion thread.
+ */
+static void prefetchDone(void *arg, long res)
+{
+	struct prefetch *p = arg;
+	struct block_cache *cache = p->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t n = 0; res >= 0 && p->writes == cache->writes &&
+			   n < p->count; n++) {
+		if (lookup(cache, p->block + n) != NO_ENTRY)
+			continue;
+
+		int i = cache->tail;
+		struct cache_entry *e = &cache->entries[i];
+		if (e->valid && e->dirty)
+			break;
+		if (e->valid)
+			hashRemove(cache, i);
+		memcpy(e->data, &p->data[n * BLOCK_SIZE], BLOCK_SIZE);
+		claimEntry(cache, i, p->block + n);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	free(p);
+}
+
+int cache_prefetch(struct block_cache *cache, size_t block, size_t count)
+{
+	if (cache->nblocks == 0)
+		return 0;
+
+	/* Never read ahead more than half the cache */
+	if (count > cache->nblocks / 2)
+		count = cache->nblocks / 2;
+
+	/* Skip the ends of the range that are already cached */
+	pthread_mutex_lock(&cache->lock);
+	while (count > 0 && lookup(cache, block) != NO_ENTRY) {
+		block++;
+		count--;
+	}
+	while (count > 0 && lookup(cache, block + count - 1) != NO_ENTRY)
+		count--;
+	unsigned long writes = cache->writes;
+	pthread_mutex_unlock(&cache->lock);
+	if (count == 0)
+		return 0;
+
+	struct prefetch *p = malloc(sizeof(*p) + count * BLOCK_SIZE);
+	if (p == NULL)
+		return -1;
+	p->cache = cache;
+	p->block = block;
+	p->count = count;
+	p->writes = writes;
+	if (disk_read_async(cache->disk, block, count, p->data, prefetchDone,
+			    p) == -1) {
+		free(p);
+		return -1;
+	}
+	disk_aio_submit(cache->disk);
+	return 0;
+}
+
+void cache_drop_range(struct block_cache *cache, size_t block, size_t count)
+{
+	if (cache->nblocks == 0)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	for (size_t n = 0; n < count; n++) {
+		int i = lookup(cache, block + n);
+		if (i == NO_ENTRY || cache->entries[i].dirty)
+			continue;
+		hashRemove(cache, i);
+		cache->entries[i].valid = false;
+		/* Free entries are recycled first */
+		lruUnlink(cache, i);
+		lruPushBack(cache, i);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_stats(struct block_cache *cache, unsigned long *hits,
+		 unsigned long *misses)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,224 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Opaque block cache instance */
+struct block_cache;
+
+/**
+ * cache_create - Create a block cache
+ * @disk: Virtual disk holding the cached blocks
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Create a write-back LRU cache sitting in front of virtual disk @disk. A cache of size 0 is valid and simply forwards every request to the
+ * disk layer. The cache can be used by several threads at once.
+ *
+ * Return: NULL if memory cannot be allocated. The new cache otherwise.
+ */
+struct block_cache *cache_create(struct disk *disk, size_t nblocks);
+
+/**
+ * cache_destroy - Destroy a block cache
+ * @cache: Block cache
+ *
+ * Write back every dirty block held by @cache and release it.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_destroy(struct block_cache *cache);
+
+/**
+ * cache_flush - Write back dirty blocks
+ * @cache: Block cache
+ *
+ * Write every dirty block held by @cache to the disk. Blocks stay cached.
+ *
+ * Return: -1 if a dirty block could not be written back. 0 otherwise.
+ */
+int cache_flush(struct block_cache *cache);
+
+/**
+ * cache_flush_block - Write back one block
+ * @cache: Block cache
+ * @block: Index of the block
+ *
+ * Write block @block to disk if it is cached and dirty.
+ *
+ * Return: -1 if the block could not be written back. 0 otherwise.
+ */
+int cache_flush_block(struct block_cache *cache, size_t block);
+
+/**
+ * cache_read - Read part of a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to read from
+ * @offset: Offset within the block
+ * @len: Number of bytes to read
+ * @buf: Data buffer to be filled
+ *
+ * Copy @len bytes starting at @offset of block @block into @buf, loading the
+ * block from disk first if it is not cached.
+ *
+ * Return: -1 if the block cannot be read. 0 otherwise.
+ */
+int cache_read(struct block_cache *cache, size_t block, size_t offset,
+	       size_t len, void *buf);
+
+/**
+ * cache_read_through - Read a whole block without filling the cache
+ * @cache: Block cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * If block @block is cached, copy it into @buf. Otherwise read it from disk
+ * straight into @buf, without going through a bounce buffer and without
+ * evicting anything from the cache.
+ *
+ * Return: -1 if the block cannot be read. 0 otherwise.
+ */
+int cache_read_through(struct block_cache *cache, size_t block, void *buf);
+
+/**
+ * cache_write - Write part of a block through the cache
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @offset: Offset within the block
+ * @len: Number of bytes to write
+ * @buf: Data buffer to write in the block
+ *
+ * Copy @len bytes from @buf into block @block at @offset. The block is only
+ * written to disk when it gets evicted or flushed. A partial write of a block
+ * that is not cached loads it from disk first.
+ *
+ * Return: -1 if the block cannot be read or written. 0 otherwise.
+ */
+int cache_write(struct block_cache *cache, size_t block, size_t offset,
+		size_t len, const void *buf);
+
+/**
+ * cache_overwrite - Write part of a block without keeping the rest
+ * @cache: Block cache
+ * @block: Index of the block to write to
+ * @offset: Offset within the block
+ * @len: Number of bytes to write
+ * @buf: Data buffer to write in the block
+ *
+ * Same as cache_write(), except that the caller does not care about the bytes
+ * of the block outside of [@offset, @offset + @len). The block is never read
+ * from disk; if it is not cached, those bytes are zeroed.
+ *
+ * Return: -1 if the block cannot be written. 0 otherwise.
+ */
+int cache_overwrite(struct block_cache *cache, size_t block, size_t offset,
+		    size_t len, const void *buf);
+
+/**
+ * cache_read_range - Read consecutive whole blocks around the cache
+ * @cache: Block cache
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled (@count * %BLOCK_SIZE bytes)
+ *
+ * Copy the leading blocks of the range that are cached, read the others from
+ * disk with a single request, then patch in the blocks that are dirty in the
+ * cache. The cache is not filled.
+ *
+ * Return: -1 if the blocks cannot be read. 0 otherwise.
+ */
+int cache_read_range(struct block_cache *cache, size_t block, size_t count,
+		     void *buf);
+
+/**
+ * cache_write_range - Write consecutive whole blocks around the cache
+ * @cache: Block cache
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write (@count * %BLOCK_SIZE bytes)
+ *
+ * Write the blocks to disk with a single request. Cached copies of these
+ * blocks are updated and become clean.
+ *
+ * Return: -1 if the blocks cannot be written. 0 otherwise.
+ */
+int cache_write_range(struct block_cache *cache, size_t block, size_t count,
+		      const void *buf);
+
+/**
+ * cache_flush_range - Write back consecutive blocks
+ * @cache: Block cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Same as cache_flush_block(), for each block of the range. Used before the
+ * blocks are read from disk behind the cache's back.
+ *
+ * Return: -1 if a block could not be written back. 0 otherwise.
+ */
+int cache_flush_range(struct block_cache *cache, size_t block, size_t count);
+
+/**
+ * cache_update_range - Refresh cached copies of consecutive blocks
+ * @cache: Block cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ * @buf: New content of the blocks (@count * %BLOCK_SIZE bytes)
+ *
+ * Copy @buf into the blocks of the range that are cached, and mark them clean.
+ * Used when the blocks are written to disk behind the cache's back, so the
+ * cache never serves or writes back an older copy.
+ */
+void cache_update_range(struct block_cache *cache, size_t block, size_t count,
+			const void *buf);
+
+/**
+ * cache_note_write - Report a write made to disk behind the cache's back
+ * @cache: Block cache
+ *
+ * Prefetches in flight are dropped rather than cached, as they may have read
+ * the blocks before the write landed.
+ */
+void cache_note_write(struct block_cache *cache);
+
+/**
+ * cache_prefetch - Read blocks into the cache in the background
+ * @cache: Block cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Queue an asynchronous read of the blocks of the range that are not cached
+ * (disk_aio_start() must have been called), and return. The blocks are cached
+ * once read, taking the place of the least recently used clean blocks. At
+ * most half the cache is filled by one call. The disk's requests must be
+ * drained before @cache is destroyed.
+ *
+ * Return: -1 if the read cannot be queued. 0 otherwise.
+ */
+int cache_prefetch(struct block_cache *cache, size_t block, size_t count);
+
+/**
+ * cache_drop_range - Forget clean cached copies of consecutive blocks
+ * @cache: Block cache
+ * @block: Index of the first block
+ * @count: Number of blocks
+ *
+ * Clean blocks of the range leave the cache, and their entries are the next
+ * ones recycled. Dirty blocks stay cached.
+ */
+void cache_drop_range(struct block_cache *cache, size_t block, size_t count);
+
+/**
+ * cache_stats - Get the hit and miss counts of a cache
+ * @cache: Block cache
+ * @hits: Filled with the number of blocks found in the cache
+ * @misses: Filled with the number of blocks that had to come from disk
+ *
+ * Reads and writes of single blocks and range reads are counted. A cache of
+ * size 0 counts nothing.
+ */
+void cache_stats(struct block_cache *cache, unsigned long *hits,
+		 unsigned long *misses);
+
+#endif /* _CACHE_H */
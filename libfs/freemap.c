@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "freemap.h"
+
+#define WORD_BITS 64
+
+/*
+ * Two-level bitmap: a set bit in @words marks a free block, and a set bit in
+ * @summary marks a word of @words that still has a free block. Finding the
+ * lowest free block takes one find-first-set per level, so the cost does not
+ * depend on how full the disk is.
+ */
+struct freemap {
+	size_t nblocks;
+	size_t nfree;
+	size_t nwords;
+	uint64_t *words;
+	size_t nsummary;
+	uint64_t *summary;
+	/* Free runs examined by freemap_alloc_run() */
+	size_t scans;
+};
+
+struct freemap *freemap_create(size_t nblocks)
+{
+	struct freemap *map = malloc(sizeof(*map));
+	if (map == NULL)
+		return NULL;
+
+	map->nblocks = nblocks;
+	map->nfree = 0;
+	map->scans = 0;
+	map->nwords = (nblocks + WORD_BITS - 1) / WORD_BITS;
+	map->nsummary = (map->nwords + WORD_BITS - 1) / WORD_BITS;
+	map->words = calloc(map->nwords ? map->nwords : 1, sizeof(uint64_t));
+	map->summary = calloc(map->nsummary ? map->nsummary : 1, sizeof(uint64_t));
+	if (!map->words || !map->summary) {
+		freemap_destroy(map);
+		return NULL;
+	}
+	return map;
+}
+
+void freemap_destroy(struct freemap *map)
+{
+	free(map->words);
+	free(map->summary);
+	free(map);
+}
+
+void freemap_set_free(struct freemap *map, size_t block)
+{
+	size_t w = block / WORD_BITS;
+	uint64_t bit = (uint64_t)1 << (block % WORD_BITS);
+
+	if (map->words[w] & bit)
+		return;
+	map->words[w] |= bit;
+	map->summary[w / WORD_BITS] |= (uint64_t)1 << (w % WORD_BITS);
+	map->nfree++;
+}
+
+void freemap_set_used(struct freemap *map, size_t block)
+{
+	size_t w = block / WORD_BITS;
+	uint64_t bit = (uint64_t)1 << (block % WORD_BITS);
+
+	if (!(map->words[w] & bit))
+		return;
+	map->words[w] &= ~bit;
+	if (map->words[w] == 0)
+		map->summary[w / WORD_BITS] &= ~((uint64_t)1 << (w % WORD_BITS));
+	map->nfree--;
+}
+
+int freemap_is_free(const struct freemap *map, size_t block)
+{
+	return (map->words[block / WORD_BITS] >> (block % WORD_BITS)) & 1;
+}
+
+size_t freemap_alloc(struct freemap *map)
+{
+	if (map->nfree == 0)
+		return FREEMAP_FULL;
+
+	for (size_t s = 0; s < map->nsummary; s++) {
+		if (map->summary[s] == 0)
+			continue;
+		size_t w = s * WORD_BITS + __builtin_ctzll(map->summary[s]);
+		size_t block = w * WORD_BITS + __builtin_ctzll(map->words[w]);
+		freemap_set_used(map, block);
+		return block;
+	}
+	return FREEMAP_FULL;
+}
+
+/* Index of the first free block at or after @pos (@nblocks if none) */
+static size_t nextFree(const struct freemap *map, size_t pos)
+{
+	if (pos >= map->nblocks)
+		return map->nblocks;
+
+	size_t w = pos / WORD_BITS;
+	uint64_t bits = map->words[w] & (~(uint64_t)0 << (pos % WORD_BITS));
+	while (bits == 0) {
+		if (++w >= map->nwords)
+			return map->nblocks;
+		bits = map->words[w];
+	}
+	return w * WORD_BITS + __builtin_ctzll(bits);
+}
+
+/* Index of the first used block at or after @pos (@nblocks if none) */
+static size_t nextUsed(const struct freemap *map, size_t pos)
+{
+	if (pos >= map->nblocks)
+		return map->nblocks;
+
+	size_t w = pos / WORD_BITS;
+	uint64_t bits = ~map->words[w] & (~(uint64_t)0 << (pos % WORD_BITS));
+	while (bits == 0) {
+		if (++w >= map->nwords)
+			return map->nblocks;
+		bits = ~map->words[w];
+	}
+	size_t block = w * WORD_BITS + __builtin_ctzll(bits);
+	return block < map->nblocks ? block : map->nblocks;
+}
+
+size_t freemap_alloc_run(struct freemap *map, size_t want, size_t hint,
+			 size_t *len)
+{
+	size_t start = FREEMAP_FULL, found = 0;
+
+	if (map->nfree == 0 || want == 0)
+		return FREEMAP_FULL;
+
+	if (hint < map->nblocks && freemap_is_free(map, hint)) {
+		start = hint;
+		found = nextUsed(map, hint) - hint;
+		map->scans++;
+	} else {
+		/* First fit, falling back on the longest run */
+		size_t pos = nextFree(map, 0);
+		while (pos < map->nblocks) {
+			size_t end = nextUsed(map, pos);
+			map->scans++;
+			if (end - pos > found) {
+				start = pos;
+				found = end - pos;
+				if (found >= want)
+					break;
+			}
+			pos = nextFree(map, end);
+		}
+	}
+
+	if (found > want)
+		found = want;
+	for (size_t i = 0; i < found; i++)
+		freemap_set_used(map, start + i);
+	*len = found;
+	return start;
+}
+
+size_t freemap_count_free(const struct freemap *map)
+{
+	return map->nfree;
+}
+
+size_t freemap_scans(const struct freemap *map)
+{
+	return map->scans;
+}
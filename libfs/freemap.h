@@ -0,0 +1,91 @@
+#ifndef _FREEMAP_H
+#define _FREEMAP_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Returned by freemap_alloc() when no block is free */
+#define FREEMAP_FULL ((size_t)-1)
+
+/** Opaque free-space index */
+struct freemap;
+
+/**
+ * freemap_create - Create a free-space index
+ * @nblocks: Number of blocks tracked by the index
+ *
+ * All blocks start out as used.
+ *
+ * Return: NULL if memory cannot be allocated. The new index otherwise.
+ */
+struct freemap *freemap_create(size_t nblocks);
+
+/**
+ * freemap_destroy - Release a free-space index
+ * @map: Free-space index
+ */
+void freemap_destroy(struct freemap *map);
+
+/**
+ * freemap_set_free - Mark a block as free
+ * @map: Free-space index
+ * @block: Block index
+ */
+void freemap_set_free(struct freemap *map, size_t block);
+
+/**
+ * freemap_set_used - Mark a block as used
+ * @map: Free-space index
+ * @block: Block index
+ */
+void freemap_set_used(struct freemap *map, size_t block);
+
+/**
+ * freemap_is_free - Test whether a block is free
+ * @map: Free-space index
+ * @block: Block index
+ */
+int freemap_is_free(const struct freemap *map, size_t block);
+
+/**
+ * freemap_alloc - Allocate the lowest free block
+ * @map: Free-space index
+ *
+ * Find the free block with the lowest index and mark it as used.
+ *
+ * Return: %FREEMAP_FULL if every block is used. The block index otherwise.
+ */
+size_t freemap_alloc(struct freemap *map);
+
+/**
+ * freemap_alloc_run - Allocate a run of consecutive blocks
+ * @map: Free-space index
+ * @want: Number of blocks wanted
+ * @hint: Preferred first block (e.g. the block following the end of a file)
+ * @len: Filled with the number of blocks actually allocated
+ *
+ * If block @hint is free, allocate as many free blocks as possible (up to
+ * @want) starting there. Otherwise allocate the lowest run of @want free
+ * blocks, or the longest free run if none is long enough.
+ *
+ * Return: %FREEMAP_FULL if every block is used. The first block of the run
+ * otherwise.
+ */
+size_t freemap_alloc_run(struct freemap *map, size_t want, size_t hint,
+			 size_t *len);
+
+/**
+ * freemap_count_free - Get the number of free blocks
+ * @map: Free-space index
+ */
+size_t freemap_count_free(const struct freemap *map);
+
+/**
+ * freemap_scans - Get the number of free runs examined by freemap_alloc_run()
+ * @map: Free-space index
+ *
+ * Tells how much searching allocations take: a run that starts at its hint
+ * counts as one.
+ */
+size_t freemap_scans(const struct freemap *map);
+
+#endif /* _FREEMAP_H */
@@ -4,13 +4,33 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "disk.h"
+#include "freemap.h"
 #include "fs.h"
+#include "journal.h"
+#include "trace.h"
+#include "nameidx.h"
 
 #define RDENTRYSIZE 32
+#define ENTRIES_PER_BLOCK (BLOCK_SIZE/RDENTRYSIZE)
+#define FAT_PER_BLOCK (BLOCK_SIZE/2)	// 16 bits per entry
 #define FAT_EOC 0xFFFF
+#define FAT_ERROR 0xFFFE	// from getFAT(), never a block number (at most 65534 blocks in all)
+
+// Bounds of the readahead window, in blocks
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 64
+
+// Values of RDentry.entryType (0 on images that predate directories)
+#define ENTRY_FILE 0
+#define ENTRY_DIR 1
 
 struct __attribute__((packed)) SuperBlock {
 	uint64_t signature;
@@ -19,513 +39,3814 @@ struct __attribute__((packed)) SuperBlock {
 	uint16_t dataBStartIndex;
 	uint16_t numDblocks;
 	uint16_t numFATBs;
-	uint8_t padding[BLOCK_SIZE-17];
+	uint16_t numRDBs;	// root directory blocks, 0 on images that predate it (1)
+	uint16_t numJBs;	// journal blocks, after the data blocks (0 if none)
+	uint16_t features;	// FEATURE_* bits, 0 with SIGNATURE
+	uint8_t padding[BLOCK_SIZE-24];
 };
 
+// Images using features that older implementations would damage get another
+// signature, since those only check the signature and the layout
+#define SIGNATURE "ECS150FS"
+#define FEATURES_SIGNATURE "ECS150FX"
+#define FEATURE_SPARSE 0x0001	// files may have holes (RDentry.holeMap)
+#define FEATURE_INLINE 0x0002	// small files may be inline (RDentry.inlineEntries)
+#define FEATURES_KNOWN (FEATURE_SPARSE | FEATURE_INLINE)
+
 struct __attribute__((packed)) RDentry {
 	uint8_t filename[FS_FILENAME_LEN];
 	uint32_t fileSize;
 	uint16_t firstDBIndex;
-	uint8_t padding[RDENTRYSIZE-22];
+	uint8_t entryType;
+	uint16_t holeMap;	// data block listing the file's holes, 0 if none
+	uint16_t inlineEntry;	// first of the entries holding the data of an inline file
+	uint8_t inlineEntries;	// number of them, 0 if the file is not inline
+	uint8_t padding[RDENTRYSIZE-28];
 };
 
-struct __attribute__((packed)) fileDesc{
-	size_t offset;
-	int placeInRD;
+// Small files are stored inline, in unused entries of their directory: the
+// first byte of each entry stays 0, so that it still looks unused, and the
+// others hold data
+#define INLINE_BYTES (RDENTRYSIZE-1)
+#define INLINE_MAX_ENTRIES 9
+#define INLINE_MAX (INLINE_MAX_ENTRIES*INLINE_BYTES)
+
+// Holes of a sparse file: ranges of blocks that read as zeros and have no data
+// block. The chain only links the allocated blocks, in file order. Sorted, and
+// never empty nor adjacent to each other.
+#define HOLES_PER_BLOCK ((BLOCK_SIZE-4)/8)
+
+struct __attribute__((packed)) Hole {
+	uint32_t start;	// first block of the hole, in blocks from the start of the file
+	uint32_t len;
 };
 
+struct __attribute__((packed)) HoleBlock {
+	uint32_t numHoles;
+	struct Hole holes[HOLES_PER_BLOCK];
+};
 
-struct SuperBlock supB;
-struct RDentry rDir[FS_FILE_MAX_COUNT];
-struct fileDesc fdTable[FS_OPEN_MAX_COUNT];
+// Hole map of a file, loaded when the file is opened and kept in memory until
+// the file is deleted or the file system is unmounted
+struct HoleMap {
+	uint16_t block;	// data block holding it (a one-block chain)
+	bool dirty;	// set when it differs from the disk
+	bool logged;	// set when only the journal holds it
+	struct HoleBlock data;
+	struct HoleMap *next;	// list of all loaded hole maps
+};
 
-uint16_t *FAT;	// since 16 bits per entry (2 bytes)
+// Returned by findCurrBlock() for a block in a hole (data block 0 is reserved)
+#define HOLE_BLOCK 0
+
+// Directory loaded in memory: the root directory, or a directory file whose
+// data blocks hold an array of RDentry. Once loaded, a directory stays in
+// memory until it is removed or the file system is unmounted, so resolving a
+// path never reads or scans a directory block again.
+struct Directory {
+	struct RDentry *entries;
+	int numEntries;
+	int numBlocks;
+	size_t *diskBlocks;	// disk block holding each block of entries
+	bool *dirty;	// one flag per block, set when it differs from the disk
+	bool *logged;	// one flag per block, set when only the journal holds it
+	struct name_index *names;	// filename -> entry
+	struct freemap *freeEntries;
+	struct Directory **subdirs;	// loaded subdirectory of each entry, or NULL
+	struct Directory *parent;	// NULL for the root directory
+	int placeInParent;
+	struct Directory *nextLoaded;	// list of all loaded directories
+};
 
-bool mounted = false;
+struct fileDesc{
+	size_t offset;
+	struct Directory *dir;	// directory holding the file's entry, NULL if closed
+	int placeInDir;
+	size_t cursorBlock;	// position of cursorDB in the chain (its block index within the file, but for holes)
+	uint16_t cursorDB;	// last data block visited, FAT_EOC if none
+	size_t raNext;	// offset where a sequential read would start
+	size_t raWindow;	// blocks to keep prefetched ahead of the reader
+	size_t raBlock;	// logical block where prefetching stopped
+	int advice;	// last FS_ADVICE_* given to fs_advise()
+	pthread_mutex_t lock;	// protects everything above but dir and placeInDir
+};
 
-int NumOfFreeFATs(void){
-	int total = 0;
-	for(int i=0; i < supB.numDblocks; i++){
-		if(FAT[i] == 0){
-			total++;
-		}
-	}
-	return total;
-}
+// One fs_read_async() or fs_write_async() call. Its whole blocks go out as one
+// disk request per run of contiguous blocks; it completes when the last one
+// does.
+struct aioRequest {
+	void *userData;
+	int result;	// bytes transferred, known at submission
+	bool failed;	// a disk request failed
+	int pending;	// disk requests in flight, plus one until submission ends
+	struct aioRequest *next;	// in the list of completed requests
+};
 
-uint16_t allocateNextFAT(uint16_t curr_DB){
-	uint16_t i = -1;
-	do{
-		i++;
-	}
-	while(i < supB.numDblocks && FAT[i] != 0);
 
-	if(i < supB.numDblocks){
-		FAT[curr_DB] = i;
-		FAT[i] = FAT_EOC;
-		return i;
-	}
-	return FAT_EOC;
-}
+// One mounted file system
+struct fs_ctx {
+	struct disk *disk;
+	struct SuperBlock supB;
+	struct fileDesc fdTable[FS_OPEN_MAX_COUNT];
+
+	struct Directory *root;	// numRDBs blocks, read whole at mount
+	struct Directory *dirs;	// all loaded directories, root included
+	struct HoleMap *holeMaps;	// those of the sparse files opened so far
+	uint16_t numRDBs;
+
+	// FAT blocks, paged in on demand: fatPages[i] is NULL until block i is
+	// read. Dirty and logged blocks stay resident; clean ones are evicted
+	// least recently used first once fatMax of them are resident. Pages and
+	// their bookkeeping are protected by fatLock (taken last), so that
+	// lookups can run under a shared metaLock.
+	uint16_t **fatPages;
+	uint64_t *fatUsed;	// LRU stamp of each resident block
+	uint64_t fatClock;
+	size_t fatResident;
+	size_t fatMax;	// 0 for no limit
+	pthread_mutex_t fatLock;
+	bool *fatDirty;	// one flag per FAT block, set when it differs from the disk
+	bool *fatLogged;	// one flag per FAT block, set when only the journal holds it
+
+	struct journal *journal;	// NULL on images without a journal
+	size_t pendingBlocks;	// dirty metadata blocks (may overcount)
+	struct timespec pendingSince;	// when the first of them became dirty
+
+	struct block_cache *cache;
+	size_t cacheBlocks;	// 0 if the cache is disabled, which disables readahead
+	bool diskMapped;	// disk opened with mapping enabled
+	struct freemap *freeMap;	// free data blocks, built from the FAT on first use
+	pthread_mutex_t freeMapLock;	// serializes building it under a shared metaLock
+
+	// File being moved by fs_ctx_defrag(), NULL if none: defragLen blocks go to
+	// the run starting at defragTarget (reserved in freeMap only), and the
+	// first defragDone of them are in place
+	struct Directory *defragDir;
+	int defragEntry;
+	uint16_t defragTarget;
+	size_t defragLen;
+	size_t defragDone;
+
+	// Protects everything above except the contents of fdTable entries, which
+	// are protected by their own lock. Readers of files and metadata take it
+	// shared; anything that allocates blocks, loads a directory or changes the
+	// FAT, a directory or fdTable takes it exclusive. Lock order: metaLock, then a fileDesc lock,
+	// then the cache's lock.
+	pthread_rwlock_t metaLock;
+
+	// Asynchronous requests, protected by aioLock (taken last, and by the
+	// disk's completion thread)
+	bool aioThreads;	// use worker threads rather than io_uring
+	int aioOutstanding;	// started and not collected by fs_aio_wait()
+	struct aioRequest *aioDone, *aioDoneTail;	// completed, not collected
+	pthread_mutex_t aioLock;
+	pthread_cond_t aioCond;	// signaled when a request completes
+
+	// Statistics, updated with relaxed atomic operations whatever the lock held
+	struct fs_op_stats opStats[FS_OP_COUNT];
+	uint64_t fatHops;
+	uint64_t journalCommits;
+
+	// Trace being recorded, set and cleared under traceLock
+	struct trace *trace;
+	pthread_mutex_t traceLock;
+};
 
-int NumOfFreeRootEntries(void){
-	int total = 0;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++){
-		if(rDir[i].filename[0] == '\0')
-			total++;
-	}
-	return total;
-}
+// An fs_* call being timed (and traced)
+struct opCall {
+	int op;
+	uint64_t start;
+	int fd;
+	size_t offset;
+	size_t size;
+	const char *path;
+};
+
+// What holes read as
+static const uint8_t zeroBlock[BLOCK_SIZE];
+
+// Context used by the functions that do not take one, mounted by fs_mount().
+// defaultLock is held shared while defaultCtx is in use, and exclusive to
+// mount or unmount it.
+static struct fs_ctx *defaultCtx = NULL;
+static pthread_rwlock_t defaultLock = PTHREAD_RWLOCK_INITIALIZER;
+
+static const char *const opNames[FS_OP_COUNT] = {
+	[FS_OP_CREATE] = "create",
+	[FS_OP_DELETE] = "delete",
+	[FS_OP_MKDIR] = "mkdir",
+	[FS_OP_RMDIR] = "rmdir",
+	[FS_OP_OPEN] = "open",
+	[FS_OP_CLOSE] = "close",
+	[FS_OP_STAT] = "stat",
+	[FS_OP_LSEEK] = "lseek",
+	[FS_OP_READ] = "read",
+	[FS_OP_WRITE] = "write",
+	[FS_OP_FALLOCATE] = "fallocate",
+	[FS_OP_FSYNC] = "fsync",
+	[FS_OP_SYNC] = "sync",
+	[FS_OP_FLUSH] = "flush",
+	[FS_OP_READ_VIEW] = "read_view",
+	[FS_OP_ADVISE] = "advise",
+	[FS_OP_READ_ASYNC] = "read_async",
+	[FS_OP_WRITE_ASYNC] = "write_async",
+};
 
-bool IsFilenameValid(const char *filename){
-	int fnamelen = strlen(filename);
-	return filename != NULL && fnamelen < FS_FILENAME_LEN && filename[fnamelen] == '\0';
+void statAdd(uint64_t *counter, uint64_t n){
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-bool IsvalidSignature(){
-	char buf[9];
-	memcpy(buf, &supB.signature, 8);
-	buf[8] = '\0';
-	return strcmp(buf, "ECS150FS") == 0;
+uint64_t statClock(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
 }
 
-int fs_mount(const char *diskname) {
-	if(block_disk_open(diskname) != 0){
-		return -1;
-	}
- 
-	bool supBvalid = block_read(0, &supB) == 0 && 
-	 				 IsvalidSignature() && 
-	 				 supB.totBlocks == block_disk_count() &&
-					 supB.dataBStartIndex == supB.rootDirBlockIndex + 1 &&
-					 supB.dataBStartIndex + supB.numDblocks == supB.totBlocks;
+// Starts timing a call; the arguments are what its trace record shows
+struct opCall opBegin(int op, int fd, size_t offset, size_t size, const char *path){
+	struct opCall call = {op, statClock(), fd, offset, size, path};
+	return call;
+}
 
-	if(!supBvalid){
-		block_disk_close();
-		return -1;	
+void traceCall(struct fs_ctx *ctx, const struct opCall *call, uint64_t end, int ret){
+	struct fs_trace_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.time_ns = call->start;
+	rec.offset = call->offset;
+	rec.duration_ns = end - call->start > UINT32_MAX ? UINT32_MAX : end - call->start;
+	rec.size = call->size > UINT32_MAX ? UINT32_MAX : call->size;
+	rec.result = ret;
+	rec.fd = call->fd;
+	rec.op = call->op;
+	pthread_mutex_lock(&ctx->traceLock);
+	if(ctx->trace != NULL){
+		trace_record(ctx->trace, &rec, call->path);
 	}
+	pthread_mutex_unlock(&ctx->traceLock);
+}
 
-	FAT = (uint16_t *)malloc(supB.numFATBs * BLOCK_SIZE);  // making an array of FATS 
-	
-	if(FAT == NULL){
-		block_disk_close();
-		return -1;
+// Records the end of @call, which returned @ret (bytes transferred by reads and
+// writes, negative on failure). Returns @ret.
+int opEnd(struct fs_ctx *ctx, const struct opCall *call, int ret){
+	if(ctx == NULL){
+		return ret;
 	}
-
-	bool fatCopySuccess = true;
-	for(int i = 0; i < supB.numFATBs ; i++){  // copying each FAT block to the proper FAT number
-		if (-1 == block_read(i+1, &FAT[i*BLOCK_SIZE/2])) {
-			fatCopySuccess = false;
-		}
+	struct fs_op_stats *st = &ctx->opStats[call->op];
+	uint64_t end = statClock();
+	uint64_t ns = end - call->start;
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if(bucket >= FS_STATS_BUCKETS){
+		bucket = FS_STATS_BUCKETS - 1;
 	}
-	if (!fatCopySuccess){
-		free(FAT);
-		block_disk_close();
-		return -1;
+	statAdd(&st->calls, 1);
+	statAdd(&st->total_ns, ns);
+	statAdd(&st->latency[bucket], 1);
+	if(ret < 0){
+		statAdd(&st->errors, 1);
+	} else if(call->op == FS_OP_READ || call->op == FS_OP_WRITE){
+		statAdd(&st->bytes, ret);
 	}
-		
-	if(-1 == block_read(supB.rootDirBlockIndex, rDir)){  // copying over the root block dir
-		free(FAT);
-		block_disk_close();
-		return -1;
+	if(__atomic_load_n(&ctx->trace, __ATOMIC_ACQUIRE) != NULL){
+		traceCall(ctx, call, end, ret);
 	}
+	return ret;
+}
 
-	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
-		fdTable[i].placeInRD = -1;
+// Sets the dirty flag of a metadata block, counting it for group commit
+void markDirty(struct fs_ctx *ctx, bool *flag){
+	if(*flag){
+		return;
+	}
+	*flag = true;
+	if(ctx->pendingBlocks++ == 0){
+		clock_gettime(CLOCK_MONOTONIC, &ctx->pendingSince);
 	}
-	
-	mounted = true;
-	return 0;
 }
 
-
-int fs_umount(void)
-{	
-	if(!mounted){
-		return -1;
-	}
-	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
-		if(fdTable[i].placeInRD != -1){	// there are still open file descriptors
-			return -1;
+// Drops the least recently used FAT block that only the disk needs, and
+// returns its buffer. Returns NULL if every resident block is dirty or logged.
+uint16_t *evictFATBlock(struct fs_ctx *ctx){
+	int victim = -1;
+	for(int i = 0; i < ctx->supB.numFATBs; i++){
+		if(ctx->fatPages[i] != NULL && !ctx->fatDirty[i] && !ctx->fatLogged[i] &&
+		   (victim == -1 || ctx->fatUsed[i] < ctx->fatUsed[victim])){
+			victim = i;
 		}
 	}
+	if(victim == -1){
+		return NULL;
+	}
+	uint16_t *page = ctx->fatPages[victim];
+	ctx->fatPages[victim] = NULL;
+	ctx->fatResident--;
+	return page;
+}
 
-	mounted = false;
-
-	for(int i = 0; i < supB.numFATBs ; i++){ 
-		block_write(i+1, &FAT[i*BLOCK_SIZE/2]);
+// Returns FAT block @block, reading it if it is not resident. fatLock held.
+uint16_t *getFATBlock(struct fs_ctx *ctx, size_t block){
+	uint16_t *page = ctx->fatPages[block];
+	if(page == NULL){
+		if(ctx->fatMax > 0 && ctx->fatResident >= ctx->fatMax){
+			page = evictFATBlock(ctx);
+		}
+		if(page == NULL){
+			page = malloc(BLOCK_SIZE);
+		}
+		if(page == NULL || -1 == disk_read(ctx->disk, 1 + block, page)){
+			free(page);
+			return NULL;
+		}
+		ctx->fatPages[block] = page;
+		ctx->fatResident++;
 	}
-	free(FAT);
+	ctx->fatUsed[block] = ++ctx->fatClock;
+	return page;
+}
 
-	block_write(supB.rootDirBlockIndex, rDir);
+// Returns FAT entry @index, or FAT_ERROR if its block cannot be read
+uint16_t getFAT(struct fs_ctx *ctx, uint16_t index){
+	pthread_mutex_lock(&ctx->fatLock);
+	uint16_t *page = getFATBlock(ctx, index / FAT_PER_BLOCK);
+	uint16_t value = page != NULL ? page[index % FAT_PER_BLOCK] : FAT_ERROR;
+	pthread_mutex_unlock(&ctx->fatLock);
+	return value;
+}
 
-	if( block_disk_close() != 0 ){
-		return -1;
+int setFAT(struct fs_ctx *ctx, uint16_t index, uint16_t value){
+	pthread_mutex_lock(&ctx->fatLock);
+	uint16_t *page = getFATBlock(ctx, index / FAT_PER_BLOCK);
+	if(page != NULL){
+		page[index % FAT_PER_BLOCK] = value;
+		markDirty(ctx, &ctx->fatDirty[index / FAT_PER_BLOCK]);	// now pinned
 	}
-	
-	return 0;
+	pthread_mutex_unlock(&ctx->fatLock);
+	return page != NULL ? 0 : -1;
 }
 
+// Tells whether a walk along a chain stops at @block: the end, or a FAT read error
+bool chainStops(uint16_t block){
+	return block == FAT_EOC || block == FAT_ERROR;
+}
 
-int fs_info(void)
-{
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", supB.totBlocks);
-	printf("fat_blk_count=%d\n", supB.numFATBs);
-	printf("rdir_blk=%d\n", supB.rootDirBlockIndex);
-	printf("data_blk=%d\n", supB.dataBStartIndex);
-	printf("data_blk_count=%d\n", supB.numDblocks);
-	printf("fat_free_ratio=%d/%d\n",NumOfFreeFATs(), supB.numDblocks);
-	printf("rdir_free_ratio=%d/%d\n",NumOfFreeRootEntries(), BLOCK_SIZE/32);
-	return 0;
+void markDirDirty(struct fs_ctx *ctx, struct Directory *dir, int entry){
+	markDirty(ctx, &dir->dirty[entry / ENTRIES_PER_BLOCK]);
 }
 
+struct RDentry *fileEntry(struct fs_ctx *ctx, int fd){
+	return &ctx->fdTable[fd].dir->entries[ctx->fdTable[fd].placeInDir];
+}
 
-int fs_create(const char *filename)
-{
-	if(!mounted || !IsFilenameValid(filename)){
-		return -1;
+// Writes back the FAT blocks flagged in @flags (their dirty or logged flags),
+// consecutive ones in one vectored request. Flagged blocks are resident.
+int writeFATBlocks(struct fs_ctx *ctx, bool *flags){
+	int ret = 0;
+	int count = ctx->supB.numFATBs;
+	int i = 0;
+	while(i < count){
+		if(!flags[i]){
+			i++;
+			continue;
+		}
+		int start = i;
+		while(i < count && flags[i]){
+			flags[i++] = false;
+		}
+		if(-1 == disk_writev(ctx->disk, 1 + start, (const void *const *)&ctx->fatPages[start], i - start)){
+			memset(&flags[start], true, i - start);	// to be written again
+			ret = -1;
+		}
 	}
+	return ret;
+}
 
-	int freeRDentry = -1;
-
-	for(int i=0; i<FS_FILE_MAX_COUNT; i++){ 
-		if(rDir[i].filename[0] == '\0'){
-			if(freeRDentry == -1){
-				freeRDentry = i;
-			}
-		} else if(strcmp((char *)rDir[i].filename, filename) == 0) { // if file already exists
-			return -1;
-		} 
+// Writes back the blocks of @dir flagged in @flags (its dirty or logged
+// flags), consecutive ones in one request. They go around the cache, which may
+// hold copies of directory file blocks.
+int writeDirtyDir(struct fs_ctx *ctx, struct Directory *dir, bool *flags){
+	int ret = 0;
+	int i = 0;
+	while(i < dir->numBlocks){
+		if(!flags[i]){
+			i++;
+			continue;
+		}
+		int start = i;
+		flags[i++] = false;
+		while(i < dir->numBlocks && flags[i] && dir->diskBlocks[i] == dir->diskBlocks[i-1] + 1){
+			flags[i++] = false;
+		}
+		if(-1 == cache_write_range(ctx->cache, dir->diskBlocks[start], i - start, &dir->entries[start*ENTRIES_PER_BLOCK])){
+			memset(&flags[start], true, i - start);	// to be written again
+			ret = -1;
+		}
 	}
+	return ret;
+}
 
-	if(freeRDentry == -1) {
+// Writes back hole map @map if @flag (its dirty or logged flag) is set
+int writeHoleMap(struct fs_ctx *ctx, struct HoleMap *map, bool *flag){
+	if(!*flag){
+		return 0;
+	}
+	if(-1 == cache_write_range(ctx->cache, map->block+ctx->supB.dataBStartIndex, 1, &map->data)){
 		return -1;
 	}
-
-	strncpy((char *)rDir[freeRDentry].filename, filename, strlen(filename)+1);
-	rDir[freeRDentry].fileSize = 0;
-	rDir[freeRDentry].firstDBIndex = FAT_EOC;
-	block_write(supB.rootDirBlockIndex, rDir);
+	*flag = false;
 	return 0;
 }
 
-
-
-int fs_delete(const char *filename)
-{
-	if(!mounted || !IsFilenameValid(filename)){
-		return -1;
-	}
-
-	int RDindex = 0;
-	while(RDindex < FS_FILE_MAX_COUNT && strcmp((char *)rDir[RDindex].filename, filename) != 0){
-		++RDindex;
+// Writes back the FAT, directory and hole map blocks changed since the last
+// call.
+int writeDirtyMetadata(struct fs_ctx *ctx){
+	int ret = writeFATBlocks(ctx, ctx->fatDirty);
+	for(struct Directory *dir = ctx->dirs; dir != NULL; dir = dir->nextLoaded){
+		if(-1 == writeDirtyDir(ctx, dir, dir->dirty)){
+			ret = -1;
+		}
 	}
-	if(RDindex >= FS_FILE_MAX_COUNT){
-		return -1;
+	for(struct HoleMap *map = ctx->holeMaps; map != NULL; map = map->next){
+		if(-1 == writeHoleMap(ctx, map, &map->dirty)){
+			ret = -1;
+		}
 	}
+	return ret;
+}
 
-	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
-		if(fdTable[i].placeInRD == RDindex){
-			return -1;
+// Writes in place the FAT and directory blocks that only the journal holds,
+// flushes them to stable storage, then empties the journal.
+int checkpointMetadata(struct fs_ctx *ctx){
+	if(journal_is_empty(ctx->journal)){
+		return 0;
+	}
+	int ret = writeFATBlocks(ctx, ctx->fatLogged);
+	for(struct Directory *dir = ctx->dirs; dir != NULL; dir = dir->nextLoaded){
+		if(-1 == writeDirtyDir(ctx, dir, dir->logged)){
+			ret = -1;
 		}
 	}
-
-	if(rDir[RDindex].firstDBIndex != FAT_EOC){
-		uint16_t index = rDir[RDindex].firstDBIndex + supB.dataBStartIndex;
-		uint16_t next_index = FAT[index];
-		while(next_index != FAT_EOC){
-			FAT[index] = 0;
-			index = next_index;
-			next_index = FAT[index];
+	for(struct HoleMap *map = ctx->holeMaps; map != NULL; map = map->next){
+		if(-1 == writeHoleMap(ctx, map, &map->logged)){
+			ret = -1;
 		}
-		FAT[index] = 0;
 	}
+	if(ret == 0){
+		ret = disk_sync(ctx->disk);
+	}
+	if(ret == 0){
+		ret = journal_reset(ctx->journal);
+	}
+	return ret;
+}
 
-	rDir[RDindex].filename[0] = '\0';
-	block_write(supB.rootDirBlockIndex, rDir);
+struct metaFlags {
+	bool *dirty;
+	bool *logged;
+};
 
-	return 0;
-}
+// Appends the dirty FAT, directory and hole map blocks to the journal as one transaction,
+// after which only the journal holds them. A batch larger than the room left
+// in the journal is split, and loses its atomicity.
+int logMetadata(struct fs_ctx *ctx){
+	size_t count = 0;
+	for(int i = 0; i < ctx->supB.numFATBs; i++){
+		count += ctx->fatDirty[i];
+	}
+	for(struct Directory *dir = ctx->dirs; dir != NULL; dir = dir->nextLoaded){
+		for(int i = 0; i < dir->numBlocks; i++){
+			count += dir->dirty[i];
+		}
+	}
+	for(struct HoleMap *map = ctx->holeMaps; map != NULL; map = map->next){
+		count += map->dirty;
+	}
+	if(count == 0){
+		return 0;
+	}
 
-int fs_ls(void)
-{
-	if(!mounted){
+	size_t *targets = malloc(count * sizeof(*targets));
+	const void **images = malloc(count * sizeof(*images));
+	struct metaFlags *flags = malloc(count * sizeof(*flags));
+	if(targets == NULL || images == NULL || flags == NULL){
+		free(targets);
+		free(images);
+		free(flags);
 		return -1;
 	}
-	printf("FS Ls:\n");
-	for(int i=0; i<FS_FILE_MAX_COUNT; i++){
-		if(rDir[i].filename[0] != '\0'){
-			printf("file: %s, size: %d, data_blk: %d\n", rDir[i].filename, rDir[i].fileSize, rDir[i].firstDBIndex);
+	size_t n = 0;
+	for(int i = 0; i < ctx->supB.numFATBs; i++){
+		if(ctx->fatDirty[i]){
+			targets[n] = 1 + i;
+			images[n] = ctx->fatPages[i];
+			flags[n++] = (struct metaFlags){ &ctx->fatDirty[i], &ctx->fatLogged[i] };
+		}
+	}
+	for(struct Directory *dir = ctx->dirs; dir != NULL; dir = dir->nextLoaded){
+		for(int i = 0; i < dir->numBlocks; i++){
+			if(dir->dirty[i]){
+				targets[n] = dir->diskBlocks[i];
+				images[n] = &dir->entries[i*ENTRIES_PER_BLOCK];
+				flags[n++] = (struct metaFlags){ &dir->dirty[i], &dir->logged[i] };
+			}
+		}
+	}
+	for(struct HoleMap *map = ctx->holeMaps; map != NULL; map = map->next){
+		if(map->dirty){
+			targets[n] = map->block + ctx->supB.dataBStartIndex;
+			images[n] = &map->data;
+			flags[n++] = (struct metaFlags){ &map->dirty, &map->logged };
 		}
 	}
-	return 0;
-}
 
+	int ret = 0;
+	size_t done = 0;
+	while(done < count){
+		if(journal_room(ctx->journal) < count - done && -1 == checkpointMetadata(ctx)){
+			ret = -1;
+			break;
+		}
+		n = count - done;
+		if(n > journal_room(ctx->journal)){
+			n = journal_room(ctx->journal);
+		}
+		if(-1 == journal_commit(ctx->journal, &targets[done], &images[done], n)){
+			ret = -1;
+			break;
+		}
+		statAdd(&ctx->journalCommits, 1);
+		for(size_t i = done; i < done + n; i++){
+			*flags[i].dirty = false;
+			*flags[i].logged = true;
+		}
+		done += n;
+	}
 
-// phase 3
+	free(targets);
+	free(images);
+	free(flags);
+	return ret;
+}
 
-int fs_open(const char *filename)
-{
-	if(!mounted || !IsFilenameValid(filename)){
-		return -1;
+// Makes the metadata changes and everything written to the disk before them
+// durable: with one journal transaction and one flush when there is a journal,
+// by writing the changed blocks in place otherwise.
+int syncMetadata(struct fs_ctx *ctx){
+	ctx->pendingBlocks = 0;
+	if(ctx->journal == NULL){
+		int ret = writeDirtyMetadata(ctx);
+		if(-1 == disk_sync(ctx->disk)){
+			ret = -1;
+		}
+		return ret;
 	}
 
-	// Find the first open FD in table
-	int fd = 0;
-	while(fd<FS_OPEN_MAX_COUNT && fdTable[fd].placeInRD >= 0){
-		++fd;
+	int ret = logMetadata(ctx);
+	if(-1 == disk_sync(ctx->disk)){
+		ret = -1;
 	}
-	if( fd >= FS_OPEN_MAX_COUNT) {	// there are already FS_OPEN_MAX_COUNT files currently open
-		return -1;
+	// Nothing is dirty, so the blocks written in place are exactly the
+	// committed ones. Emptying the journal early leaves room for the next
+	// batch to fit in one transaction.
+	if(ret == 0 && journal_room(ctx->journal) < journal_capacity(ctx->journal) / 2){
+		ret = checkpointMetadata(ctx);
 	}
+	return ret;
+}
 
-	// Looking for filename in root directory
-	int rDirIndex = 0;
-	while(rDirIndex<FS_FILE_MAX_COUNT && strcmp((char *)rDir[rDirIndex].filename, filename) != 0){
-		++rDirIndex;
+// Group commit, called after every operation that may change metadata
+void maybeSyncMetadata(struct fs_ctx *ctx){
+	if(ctx->journal == NULL || ctx->pendingBlocks == 0){
+		return;
 	}
-
-	if(rDirIndex >= FS_FILE_MAX_COUNT){	// File not found in root directory
-		return -1;
+	size_t batch = journal_capacity(ctx->journal) / 4;
+	if(batch > FS_JOURNAL_COMMIT_BLOCKS){
+		batch = FS_JOURNAL_COMMIT_BLOCKS;
+	}
+	if(ctx->pendingBlocks < batch){
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long waited = (now.tv_sec - ctx->pendingSince.tv_sec) * 1000 + (now.tv_nsec - ctx->pendingSince.tv_nsec) / 1000000;
+		if(waited < FS_JOURNAL_COMMIT_MS){
+			return;
+		}
 	}
+	syncMetadata(ctx);
+}
 
-	// Store the file descriptor
-    fdTable[fd].offset = 0;
-	fdTable[fd].placeInRD = rDirIndex;
-    return fd;	// return the file descriptor (index in array)
+// Reads the whole FAT one block at a time, so that only fatMax blocks are ever
+// resident
+struct freemap *buildFreeMap(struct fs_ctx *ctx){
+	struct freemap *map = freemap_create(ctx->supB.numDblocks);
+	if(map == NULL){
+		return NULL;
+	}
+	for(size_t b = 0; b < ctx->supB.numFATBs; b++){
+		pthread_mutex_lock(&ctx->fatLock);
+		uint16_t *page = getFATBlock(ctx, b);
+		for(size_t i = b * FAT_PER_BLOCK; page != NULL && i < (b + 1) * FAT_PER_BLOCK && i < ctx->supB.numDblocks; i++){
+			if(page[i % FAT_PER_BLOCK] == 0){
+				freemap_set_free(map, i);
+			}
+		}
+		pthread_mutex_unlock(&ctx->fatLock);
+		if(page == NULL){
+			freemap_destroy(map);
+			return NULL;
+		}
+	}
+	return map;
 }
 
+// Returns the free map, building it on first use: mounting does not read the
+// FAT. Returns NULL if the FAT cannot be read.
+struct freemap *getFreeMap(struct fs_ctx *ctx){
+	struct freemap *map = __atomic_load_n(&ctx->freeMap, __ATOMIC_ACQUIRE);
+	if(map == NULL){
+		pthread_mutex_lock(&ctx->freeMapLock);
+		map = ctx->freeMap;
+		if(map == NULL){
+			map = buildFreeMap(ctx);
+			__atomic_store_n(&ctx->freeMap, map, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&ctx->freeMapLock);
+	}
+	return map;
+}
 
-bool isFDValid(int fd) {
-	return fd >= 0 && fd < FS_OPEN_MAX_COUNT && fdTable[fd].placeInRD >= 0;
+int NumOfFreeFATs(struct fs_ctx *ctx){
+	struct freemap *map = getFreeMap(ctx);
+	return map != NULL ? (int)freemap_count_free(map) : 0;
 }
 
+// Allocates a run of up to @want contiguous blocks, preferably right after
+// @curr_DB, and links it after @curr_DB (unless it is FAT_EOC). Returns the
+// first block of the run, or FAT_EOC if the disk is full or the FAT cannot be
+// read.
+uint16_t allocateExtent(struct fs_ctx *ctx, uint16_t curr_DB, size_t want){
+	struct freemap *map = getFreeMap(ctx);
+	if(map == NULL){
+		return FAT_EOC;
+	}
+	size_t hint = curr_DB == FAT_EOC ? 0 : curr_DB + 1u;
+	size_t len;
+	size_t first = freemap_alloc_run(map, want, hint, &len);
+	if(first == FREEMAP_FULL){
+		return FAT_EOC;
+	}
+	int ret = 0;
+	for(size_t i = first; ret == 0 && i + 1 < first + len; i++){
+		ret = setFAT(ctx, i, i + 1);
+	}
+	if(ret == 0){
+		ret = setFAT(ctx, first + len - 1, FAT_EOC);
+	}
+	if(ret == 0 && curr_DB != FAT_EOC){
+		ret = setFAT(ctx, curr_DB, first);
+	}
+	if(ret == -1){	// entries already set are resident and go back to 0
+		for(size_t i = first; i < first + len; i++){
+			setFAT(ctx, i, 0);
+			freemap_set_free(map, i);
+		}
+		return FAT_EOC;
+	}
+	return first;
+}
 
-int fs_close(int fd)
-{
-	if(!mounted || !isFDValid(fd)){
-		return -1;
+// Returns -1 if the chain cannot be followed to its end; the blocks past that
+// point stay allocated, for fs_check() to reclaim
+int freeChain(struct fs_ctx *ctx, uint16_t block){
+	while(block != FAT_EOC){
+		uint16_t next = getFAT(ctx, block);
+		if(next == FAT_ERROR){
+			return -1;
+		}
+		setFAT(ctx, block, 0);
+		if(ctx->freeMap != NULL){	// otherwise built from the FAT later
+			freemap_set_free(ctx->freeMap, block);
+		}
+		block = next;
 	}
-	fdTable[fd].placeInRD = -1;
 	return 0;
 }
 
-
-int fs_stat(int fd)
-{
-	if(!mounted || !isFDValid(fd)){
-		return -1;
+// Returns the hole map of file entry @e, NULL if it has none
+struct HoleMap *fileHoles(struct fs_ctx *ctx, const struct RDentry *e){
+	if(e->holeMap == 0){
+		return NULL;
+	}
+	struct HoleMap *map = ctx->holeMaps;
+	while(map != NULL && map->block != e->holeMap){
+		map = map->next;
 	}
-	int index = fdTable[fd].placeInRD;
-	return rDir[index].fileSize;
+	return map;
 }
 
-
-int fs_lseek(int fd, size_t offset)
-{
-	if(!mounted || !isFDValid(fd) || offset > rDir[fdTable[fd].placeInRD].fileSize) {
+// Loads the hole map of file entry @e, if it has one that is not loaded yet
+int loadHoles(struct fs_ctx *ctx, const struct RDentry *e){
+	if(e->holeMap == 0 || fileHoles(ctx, e) != NULL){
+		return 0;
+	}
+	if(e->holeMap >= ctx->supB.numDblocks){
+		return -1;
+	}
+	struct HoleMap *map = calloc(1, sizeof(*map));
+	if(map == NULL){
+		return -1;
+	}
+	if(-1 == cache_read_range(ctx->cache, e->holeMap+ctx->supB.dataBStartIndex, 1, &map->data) ||
+	   map->data.numHoles > HOLES_PER_BLOCK){
+		free(map);
 		return -1;
 	}
-	fdTable[fd].offset = offset;
+	map->block = e->holeMap;
+	map->next = ctx->holeMaps;
+	ctx->holeMaps = map;
 	return 0;
 }
 
-
-// phase 4
-
-uint16_t getNextBlock(uint16_t currBlock, bool write){
-	if(currBlock == FAT_EOC){
-		return FAT_EOC;
+// Gives entry @entry of @dir an empty hole map. Returns NULL if the disk is full.
+struct HoleMap *createHoles(struct fs_ctx *ctx, struct Directory *dir, int entry){
+	struct HoleMap *map = calloc(1, sizeof(*map));
+	if(map == NULL){
+		return NULL;
 	}
-	uint16_t next = FAT[currBlock];
-	if(write && next == FAT_EOC){
-		next = allocateNextFAT(currBlock);
+	map->block = allocateExtent(ctx, FAT_EOC, 1);
+	if(map->block == FAT_EOC){
+		free(map);
+		return NULL;
 	}
-	return next;
+	markDirty(ctx, &map->dirty);
+	map->next = ctx->holeMaps;
+	ctx->holeMaps = map;
+	dir->entries[entry].holeMap = map->block;
+	markDirDirty(ctx, dir, entry);
+	return map;
 }
 
-uint16_t findCurrBlock(size_t offset, uint16_t block, size_t *relativeOffset){
-	*relativeOffset = offset;
-	uint16_t curr_block = block;
-	while(*relativeOffset >= BLOCK_SIZE){
-		*relativeOffset -= BLOCK_SIZE;
-		curr_block = getNextBlock(curr_block, false);
+// Frees the hole map of file entry @e, if it has one
+int freeHoles(struct fs_ctx *ctx, struct RDentry *e){
+	if(e->holeMap == 0){
+		return 0;
+	}
+	struct HoleMap **link = &ctx->holeMaps;
+	while(*link != NULL && (*link)->block != e->holeMap){
+		link = &(*link)->next;
+	}
+	struct HoleMap *map = *link;
+	if(map != NULL){
+		// Once freed, its block may be reused for file data, which a replay
+		// of the journal must not overwrite
+		if(map->logged && (-1 == syncMetadata(ctx) || -1 == checkpointMetadata(ctx))){
+			return -1;
+		}
+		*link = map->next;
+		free(map);
 	}
-	return curr_block;
+	freeChain(ctx, e->holeMap);
+	e->holeMap = 0;
+	return 0;
 }
 
-int dataBlockWrite(int blockIndex, int startOffset, int byteCount, void* buf) {
-	if(byteCount == 0){
-		return 0;
+// Looks up block @block of a file (counted from its start) in its hole map
+// @map (NULL if it has none). Returns true if the block lies in a hole. Sets
+// @index to the position in the chain of the block, or of the first block
+// after the hole, @run to the number of blocks from @block to the next hole
+// boundary (SIZE_MAX if none), and @hole to the hole holding or following it.
+bool holeLookup(const struct HoleMap *map, size_t block, size_t *index, size_t *run, uint32_t *hole){
+	size_t skipped = 0;
+	uint32_t i = 0;
+	for(; map != NULL && i < map->data.numHoles; i++){
+		const struct Hole *h = &map->data.holes[i];
+		if(block < h->start){
+			*run = h->start - block;
+			break;
+		}
+		if(block < (size_t)h->start + h->len){
+			*index = h->start - skipped;
+			*run = h->start + h->len - block;
+			if(hole != NULL){
+				*hole = i;
+			}
+			return true;
+		}
+		skipped += h->len;
 	}
-	uint8_t bounce_buf[BLOCK_SIZE];
-	block_read(blockIndex+supB.dataBStartIndex, bounce_buf);
-
-	memcpy(&bounce_buf[startOffset], buf, byteCount);
-	if(-1 == block_write(blockIndex+supB.dataBStartIndex, bounce_buf)){
-		return -1;
+	if(map == NULL || i == map->data.numHoles){
+		*run = SIZE_MAX;
 	}
-	
-	return byteCount;
+	*index = block - skipped;
+	if(hole != NULL){
+		*hole = i;
+	}
+	return false;
 }
 
+// Returns the number of blocks in the holes of @map (NULL if none)
+size_t holeBlocks(const struct HoleMap *map){
+	size_t total = 0;
+	for(uint32_t i = 0; map != NULL && i < map->data.numHoles; i++){
+		total += map->data.holes[i].len;
+	}
+	return total;
+}
 
-int fs_write(int fd, void *buf, size_t count)
-{
-	if(!mounted || !isFDValid(fd) || buf==NULL){
-		return -1;
-	} else if(count == 0){
-		return 0;
+// Entries holding inline data count as free: they are given back to new files.
+// Without inline files, only unused entries are counted.
+int NumOfFreeRootEntries(struct fs_ctx *ctx){
+	size_t count = freemap_count_free(ctx->root->freeEntries);
+	for(int i = 0; (ctx->supB.features & FEATURE_INLINE) && i < ctx->root->numEntries; i++){
+		if(ctx->root->entries[i].filename[0] != '\0'){
+			count += ctx->root->entries[i].inlineEntries;
+		}
 	}
+	return count;
+}
 
-	int RDIndex = fdTable[fd].placeInRD;
-	size_t offset = fdTable[fd].offset;
-	size_t startingDBInd = rDir[RDIndex].firstDBIndex;
+const char *dirEntryName(const void *arg, int entry){
+	const struct Directory *dir = arg;
+	return (const char *)dir->entries[entry].filename;
+}
 
-	if(startingDBInd == FAT_EOC){
-		uint16_t i = -1;
-		do{
-			i++;
+// Rebuilds the name index and the free entry map of @dir from its entries.
+// On failure, the previous ones are kept.
+int indexDir(struct Directory *dir){
+	struct name_index *names = nameidx_create(dir->numEntries, dirEntryName, dir);
+	struct freemap *freeEntries = freemap_create(dir->numEntries);
+	if(names == NULL || freeEntries == NULL){
+		if(names != NULL){
+			nameidx_destroy(names);
 		}
-		while(i < supB.numDblocks && FAT[i] != 0);
-
-		if(i < supB.numDblocks){
-			rDir[RDIndex].firstDBIndex = i;
-			startingDBInd = i;
-			FAT[i] = FAT_EOC;
+		if(freeEntries != NULL){
+			freemap_destroy(freeEntries);
+		}
+		return -1;
+	}
+	for(int i = 0; i < dir->numEntries; i++){
+		if(dir->entries[i].filename[0] == '\0'){
+			freemap_set_free(freeEntries, i);
 		} else {
-			return 0;
+			dir->entries[i].filename[FS_FILENAME_LEN-1] = '\0';
+			nameidx_insert(names, (char *)dir->entries[i].filename, i);
+		}
+	}
+	// Entries holding inline data only look unused
+	for(int i = 0; i < dir->numEntries; i++){
+		const struct RDentry *e = &dir->entries[i];
+		for(int j = 0; e->filename[0] != '\0' && j < e->inlineEntries && e->inlineEntry + j < dir->numEntries; j++){
+			freemap_set_used(freeEntries, e->inlineEntry + j);
 		}
 	}
 
-	size_t relativeOffset;
-	size_t currBlock = findCurrBlock(offset, startingDBInd, &relativeOffset);
+	if(dir->names != NULL){
+		nameidx_destroy(dir->names);
+	}
+	if(dir->freeEntries != NULL){
+		freemap_destroy(dir->freeEntries);
+	}
+	dir->names = names;
+	dir->freeEntries = freeEntries;
+	return 0;
+}
+
+// Resizes the arrays of @dir to @numBlocks blocks. New entries are zeroed.
+int resizeDir(struct Directory *dir, int numBlocks){
+	int numEntries = numBlocks * ENTRIES_PER_BLOCK;
+	struct RDentry *entries = realloc(dir->entries, numBlocks * BLOCK_SIZE);
+	if(entries != NULL){
+		dir->entries = entries;
+	}
+	size_t *diskBlocks = realloc(dir->diskBlocks, numBlocks * sizeof(size_t));
+	if(diskBlocks != NULL){
+		dir->diskBlocks = diskBlocks;
+	}
+	bool *dirty = realloc(dir->dirty, numBlocks * sizeof(bool));
+	if(dirty != NULL){
+		dir->dirty = dirty;
+	}
+	bool *logged = realloc(dir->logged, numBlocks * sizeof(bool));
+	if(logged != NULL){
+		dir->logged = logged;
+	}
+	struct Directory **subdirs = realloc(dir->subdirs, numEntries * sizeof(*subdirs));
+	if(subdirs != NULL){
+		dir->subdirs = subdirs;
+	}
+	if(entries == NULL || diskBlocks == NULL || dirty == NULL || logged == NULL || subdirs == NULL){
+		return -1;
+	}
 
-	int buf_index = 0;
+	memset(&entries[dir->numEntries], 0, (numEntries - dir->numEntries) * RDENTRYSIZE);
+	memset(&dirty[dir->numBlocks], 0, (numBlocks - dir->numBlocks) * sizeof(bool));
+	memset(&logged[dir->numBlocks], 0, (numBlocks - dir->numBlocks) * sizeof(bool));
+	memset(&subdirs[dir->numEntries], 0, (numEntries - dir->numEntries) * sizeof(*subdirs));
+	dir->numBlocks = numBlocks;
+	dir->numEntries = numEntries;
+	return 0;
+}
 
-	int byteCount = count;
-	if(count > BLOCK_SIZE - relativeOffset){
-		byteCount = BLOCK_SIZE - relativeOffset;
-	} 
+void freeDir(struct Directory *dir){
+	if(dir->names != NULL){
+		nameidx_destroy(dir->names);
+	}
+	if(dir->freeEntries != NULL){
+		freemap_destroy(dir->freeEntries);
+	}
+	free(dir->entries);
+	free(dir->diskBlocks);
+	free(dir->dirty);
+	free(dir->logged);
+	free(dir->subdirs);
+	free(dir);
+}
 
-	int BytesWritten = dataBlockWrite(currBlock, relativeOffset, byteCount, buf);
-	if(BytesWritten == -1){
-		return 0; 
+// Reads the @numBlocks blocks of a directory (at the disk blocks given by
+// @firstBlock and the FAT for a directory file, or from @firstBlock onwards for
+// the root directory) and adds it to the loaded directories.
+struct Directory *loadDir(struct fs_ctx *ctx, struct Directory *parent, int placeInParent, size_t firstBlock, int numBlocks){
+	struct Directory *dir = calloc(1, sizeof(*dir));
+	if(dir == NULL){
+		return NULL;
 	}
-	buf_index += BytesWritten;
-	currBlock = getNextBlock(currBlock, true);
-	if(currBlock == FAT_EOC){
-		fdTable[fd].offset += buf_index + BytesWritten;
-		return buf_index;
+	if(numBlocks > 0 && -1 == resizeDir(dir, numBlocks)){
+		freeDir(dir);
+		return NULL;
 	}
 
-	// middle full blocks
-	while(count - buf_index >= BLOCK_SIZE){
-		BytesWritten = dataBlockWrite(currBlock, 0, BLOCK_SIZE, &((uint8_t*)buf)[buf_index]);
-		if(BytesWritten == -1){
-			return buf_index;  
+	uint16_t block = firstBlock;
+	for(int i = 0; i < numBlocks; i++){
+		if(parent == NULL){
+			dir->diskBlocks[i] = firstBlock + i;
+			continue;
 		}
-		buf_index += BytesWritten; 
-		currBlock = getNextBlock(currBlock, true);
-		if(currBlock == FAT_EOC){
-			fdTable[fd].offset += buf_index + BytesWritten;
-			return buf_index;
+		if(chainStops(block)){	// chain shorter than the directory size, or unreadable
+			freeDir(dir);
+			return NULL;
 		}
+		dir->diskBlocks[i] = block + ctx->supB.dataBStartIndex;
+		block = getFAT(ctx, block);
 	}
 
-	BytesWritten = dataBlockWrite(currBlock, 0, count - buf_index, &((uint8_t*)buf)[buf_index]);
-	if(BytesWritten == -1){
-		return buf_index; 
+	int i = 0;
+	while(i < numBlocks){
+		int start = i++;
+		while(i < numBlocks && dir->diskBlocks[i] == dir->diskBlocks[i-1] + 1){
+			i++;
+		}
+		if(-1 == cache_read_range(ctx->cache, dir->diskBlocks[start], i - start, &dir->entries[start*ENTRIES_PER_BLOCK])){
+			freeDir(dir);
+			return NULL;
+		}
 	}
 
-	fdTable[fd].offset += buf_index + BytesWritten;
-
-	if(fdTable[fd].offset > rDir[fdTable[fd].placeInRD].fileSize){
-		rDir[fdTable[fd].placeInRD].fileSize = fdTable[fd].offset;
+	if(-1 == indexDir(dir)){
+		freeDir(dir);
+		return NULL;
 	}
+	dir->parent = parent;
+	dir->placeInParent = placeInParent;
+	dir->nextLoaded = ctx->dirs;
+	ctx->dirs = dir;
+	return dir;
+}
 
-	block_write(supB.rootDirBlockIndex, rDir);
+struct Directory *getSubdir(struct fs_ctx *ctx, struct Directory *parent, int entry){
+	if(parent->subdirs[entry] == NULL){
+		struct RDentry *e = &parent->entries[entry];
+		parent->subdirs[entry] = loadDir(ctx, parent, entry, e->firstDBIndex, e->fileSize / BLOCK_SIZE);
+	}
+	return parent->subdirs[entry];
+}
+
+// Gives up the file being defragmented, releasing the blocks reserved for it
+void endDefrag(struct fs_ctx *ctx){
+	for(size_t i = ctx->defragDone; i < ctx->defragLen; i++){	// reserved, never linked
+		freemap_set_free(ctx->freeMap, ctx->defragTarget + i);
+	}
+	ctx->defragDir = NULL;
+}
+
+void unloadDir(struct fs_ctx *ctx, struct Directory *dir){
+	if(ctx->defragDir == dir){
+		endDefrag(ctx);
+	}
+	struct Directory **link = &ctx->dirs;
+	while(*link != dir){
+		link = &(*link)->nextLoaded;
+	}
+	*link = dir->nextLoaded;
+	if(dir->parent != NULL){
+		dir->parent->subdirs[dir->placeInParent] = NULL;
+	}
+	freeDir(dir);
+}
+
+// Adds one data block to directory file @dir, updating its own entry
+int growDir(struct fs_ctx *ctx, struct Directory *dir){
+	if(dir->parent == NULL){	// the root directory has a fixed size
+		return -1;
+	}
+	uint16_t last = FAT_EOC;
+	if(dir->numBlocks > 0){
+		last = dir->diskBlocks[dir->numBlocks-1] - ctx->supB.dataBStartIndex;
+	}
+	uint16_t block = allocateExtent(ctx, last, 1);
+	if(block == FAT_EOC){
+		return -1;
+	}
+	if(-1 == resizeDir(dir, dir->numBlocks + 1)){
+		if(last != FAT_EOC){
+			setFAT(ctx, last, FAT_EOC);
+		}
+		freeChain(ctx, block);
+		return -1;
+	}
+	dir->diskBlocks[dir->numBlocks-1] = block + ctx->supB.dataBStartIndex;
+	markDirty(ctx, &dir->dirty[dir->numBlocks-1]);
+
+	struct RDentry *self = &dir->parent->entries[dir->placeInParent];
+	if(self->firstDBIndex == FAT_EOC){
+		self->firstDBIndex = block;
+	}
+	self->fileSize += BLOCK_SIZE;
+	markDirDirty(ctx, dir->parent, dir->placeInParent);
 
-	return buf_index + BytesWritten;
+	// Without a new index, the new entries just stay unused
+	return indexDir(dir);
 }
 
+// Copies bytes [@offset, @offset + @len) of inline file @e of @dir to @buf
+void readInline(const struct Directory *dir, const struct RDentry *e, size_t offset, void *buf, size_t len){
+	for(size_t done = 0; done < len;){
+		size_t pos = offset + done;
+		size_t n = INLINE_BYTES - pos % INLINE_BYTES;
+		if(n > len - done){
+			n = len - done;
+		}
+		const uint8_t *slot = (const uint8_t *)&dir->entries[e->inlineEntry + pos / INLINE_BYTES];
+		memcpy((uint8_t *)buf + done, slot + 1 + pos % INLINE_BYTES, n);
+		done += n;
+	}
+}
 
+// Copies @len bytes of @buf (zeros if NULL) to @offset of inline file @e of @dir
+void writeInline(struct fs_ctx *ctx, struct Directory *dir, const struct RDentry *e, size_t offset, const void *buf, size_t len){
+	for(size_t done = 0; done < len;){
+		size_t pos = offset + done;
+		size_t n = INLINE_BYTES - pos % INLINE_BYTES;
+		if(n > len - done){
+			n = len - done;
+		}
+		int entry = e->inlineEntry + pos / INLINE_BYTES;
+		uint8_t *slot = (uint8_t *)&dir->entries[entry];
+		slot[0] = '\0';	// unused, to whoever reads the directory
+		if(buf != NULL){
+			memcpy(slot + 1 + pos % INLINE_BYTES, (const uint8_t *)buf + done, n);
+		} else {
+			memset(slot + 1 + pos % INLINE_BYTES, 0, n);
+		}
+		markDirDirty(ctx, dir, entry);
+		done += n;
+	}
+}
 
+// Releases the entries holding the data of inline file @e of @dir
+void freeInline(struct Directory *dir, struct RDentry *e){
+	for(int i = 0; i < e->inlineEntries; i++){
+		freemap_set_free(dir->freeEntries, e->inlineEntry + i);
+	}
+	e->inlineEntries = 0;
+}
 
-int dataBlockRead(int blockIndex, int startOffset, int byteCount, void* buf) {
-	uint8_t bounce_buf[BLOCK_SIZE];
-	if(byteCount == 0){
+// Makes room for @size bytes of data inline in entry @entry of @dir, which is
+// either inline or empty, in free entries of the directory: more entries are
+// taken after those it has, or a new run of them replaces them. A quarter of
+// the entries of the directory are kept for files. Returns -1 if there is no
+// room.
+int growInline(struct fs_ctx *ctx, struct Directory *dir, int entry, size_t size){
+	struct RDentry *e = &dir->entries[entry];
+	size_t want = (size + INLINE_BYTES - 1) / INLINE_BYTES;
+	size_t have = e->inlineEntries;
+	if(want <= have){
 		return 0;
 	}
-	if(-1 == block_read(blockIndex+supB.dataBStartIndex, bounce_buf)){
+	if(size > INLINE_MAX || freemap_count_free(dir->freeEntries) < want - have + dir->numEntries / 4){
 		return -1;
 	}
-	memcpy(buf, &bounce_buf[startOffset], byteCount);
-	return byteCount;
+
+	size_t next = e->inlineEntry + have;
+	size_t len = 0;
+	while(have > 0 && have + len < want && next + len < (size_t)dir->numEntries && freemap_is_free(dir->freeEntries, next + len)){
+		len++;
+	}
+	if(have > 0 && have + len == want){
+		for(size_t i = 0; i < len; i++){
+			freemap_set_used(dir->freeEntries, next + i);
+		}
+		e->inlineEntries = want;
+		markDirDirty(ctx, dir, entry);
+		return 0;
+	}
+
+	size_t first = freemap_alloc_run(dir->freeEntries, want, entry, &len);	// the lowest run long enough
+	if(first == FREEMAP_FULL || len < want){
+		for(size_t i = 0; first != FREEMAP_FULL && i < len; i++){
+			freemap_set_free(dir->freeEntries, first + i);
+		}
+		return -1;
+	}
+	uint8_t data[INLINE_MAX];
+	readInline(dir, e, 0, data, e->fileSize);
+	freeInline(dir, e);
+	e->inlineEntry = first;
+	e->inlineEntries = want;
+	writeInline(ctx, dir, e, 0, data, e->fileSize);
+	markDirDirty(ctx, dir, entry);
+	return 0;
+}
+
+// Moves the data of inline file @entry of @dir to a data block of its own
+int spillInline(struct fs_ctx *ctx, struct Directory *dir, int entry){
+	struct RDentry *e = &dir->entries[entry];
+	uint8_t data[INLINE_MAX];
+	readInline(dir, e, 0, data, e->fileSize);
+	uint16_t block = allocateExtent(ctx, FAT_EOC, 1);
+	if(block == FAT_EOC){
+		return -1;
+	}
+	if(-1 == cache_overwrite(ctx->cache, block+ctx->supB.dataBStartIndex, 0, e->fileSize, data)){
+		freeChain(ctx, block);
+		return -1;
+	}
+	freeInline(dir, e);
+	e->firstDBIndex = block;
+	markDirDirty(ctx, dir, entry);
+	return 0;
 }
 
+// Adds an empty entry named @name to @dir. Returns the entry or -1.
+int addEntry(struct fs_ctx *ctx, struct Directory *dir, const char *name, uint8_t type){
+	size_t entry = freemap_alloc(dir->freeEntries);	// lowest free entry
+	if(entry == FREEMAP_FULL){
+		// Entries taken by inline data are given back before the
+		// directory grows, and when it cannot
+		int i = 0;
+		while(i < dir->numEntries && (dir->entries[i].filename[0] == '\0' || dir->entries[i].inlineEntries == 0)){
+			i++;
+		}
+		if((i == dir->numEntries || -1 == spillInline(ctx, dir, i)) && -1 == growDir(ctx, dir)){
+			return -1;
+		}
+		entry = freemap_alloc(dir->freeEntries);
+	}
 
-int fs_read(int fd, void *buf, size_t count)
-{
-    if(!mounted || !isFDValid(fd) || buf==NULL){
+	struct RDentry *e = &dir->entries[entry];
+	memset(e, 0, sizeof(*e));
+	strncpy((char *)e->filename, name, FS_FILENAME_LEN);
+	e->firstDBIndex = FAT_EOC;
+	e->entryType = type;
+	nameidx_insert(dir->names, name, entry);
+	markDirDirty(ctx, dir, entry);
+	return entry;
+}
+
+void removeEntry(struct fs_ctx *ctx, struct Directory *dir, int entry){
+	nameidx_remove(dir->names, (char *)dir->entries[entry].filename);
+	freemap_set_free(dir->freeEntries, entry);
+	dir->entries[entry].filename[0] = '\0';
+	markDirDirty(ctx, dir, entry);
+}
+
+// Walks @path ("a/b/c", optionally starting with '/') down to the directory
+// holding its last component, which is copied into @name. Returns NULL if a
+// component is too long or empty, or is not an existing directory.
+struct Directory *resolveParent(struct fs_ctx *ctx, const char *path, char *name){
+	if(path == NULL){
+		return NULL;
+	}
+	if(*path == '/'){
+		path++;
+	}
+	struct Directory *dir = ctx->root;
+	for(;;){
+		const char *slash = strchr(path, '/');
+		size_t len = slash != NULL ? (size_t)(slash - path) : strlen(path);
+		if(len == 0 || len >= FS_FILENAME_LEN){
+			return NULL;
+		}
+		memcpy(name, path, len);
+		name[len] = '\0';
+		if(slash == NULL){
+			return dir;
+		}
+		int entry = nameidx_lookup(dir->names, name);
+		if(entry == -1 || dir->entries[entry].entryType != ENTRY_DIR){
+			return NULL;
+		}
+		dir = getSubdir(ctx, dir, entry);
+		if(dir == NULL){
+			return NULL;
+		}
+		path = slash + 1;
+	}
+}
+
+// Same as resolveParent(), but looks up the last component too, which must be
+// of type @type. Returns the entry or -1.
+int resolvePath(struct fs_ctx *ctx, const char *path, uint8_t type, struct Directory **dir){
+	char name[FS_FILENAME_LEN];
+	*dir = resolveParent(ctx, path, name);
+	if(*dir == NULL){
+		return -1;
+	}
+	int entry = nameidx_lookup((*dir)->names, name);
+	if(entry == -1 || (*dir)->entries[entry].entryType != type){
 		return -1;
-	} else if(count == 0){
-		return 0;
 	}
+	return entry;
+}
 
-	int RDIndex = fdTable[fd].placeInRD;
-	size_t offset = fdTable[fd].offset;
-	size_t startingDBInd = rDir[RDIndex].firstDBIndex;
+bool IsvalidSignature(const struct SuperBlock *supB){
+	char buf[9];
+	memcpy(buf, &supB->signature, 8);
+	buf[8] = '\0';
+	if(supB->features == 0){
+		return strcmp(buf, SIGNATURE) == 0;
+	}
+	return strcmp(buf, FEATURES_SIGNATURE) == 0 && (supB->features & ~FEATURES_KNOWN) == 0;
+}
 
-	size_t relativeOffset;
-	size_t currBlock = findCurrBlock(offset, startingDBInd, &relativeOffset);
+// Releases everything but the descriptor locks, which only exist once the
+// mount succeeded.
+void releaseCtx(struct fs_ctx *ctx){
+	if(ctx->cache != NULL){
+		cache_destroy(ctx->cache);
+	}
+	if(ctx->freeMap != NULL){
+		freemap_destroy(ctx->freeMap);
+	}
+	while(ctx->dirs != NULL){
+		struct Directory *next = ctx->dirs->nextLoaded;
+		freeDir(ctx->dirs);
+		ctx->dirs = next;
+	}
+	while(ctx->holeMaps != NULL){
+		struct HoleMap *next = ctx->holeMaps->next;
+		free(ctx->holeMaps);
+		ctx->holeMaps = next;
+	}
+	for(int i = 0; ctx->fatPages != NULL && i < ctx->supB.numFATBs; i++){
+		free(ctx->fatPages[i]);
+	}
+	free(ctx->fatPages);
+	free(ctx->fatUsed);
+	free(ctx->fatDirty);
+	free(ctx->fatLogged);
+	if(ctx->journal != NULL){
+		journal_close(ctx->journal);
+	}
+	if(ctx->disk != NULL){
+		disk_close(ctx->disk);
+	}
+	while(ctx->aioDone != NULL){	// completed but never collected
+		struct aioRequest *next = ctx->aioDone->next;
+		free(ctx->aioDone);
+		ctx->aioDone = next;
+	}
+	if(ctx->trace != NULL){
+		trace_close(ctx->trace);
+	}
+	pthread_cond_destroy(&ctx->aioCond);
+	pthread_mutex_destroy(&ctx->aioLock);
+	pthread_mutex_destroy(&ctx->traceLock);
+	pthread_mutex_destroy(&ctx->fatLock);
+	pthread_mutex_destroy(&ctx->freeMapLock);
+	pthread_rwlock_destroy(&ctx->metaLock);
+	free(ctx);
+}
 
-	int buf_index = 0;
+struct fs_ctx *fs_ctx_mount(const char *diskname, const struct fs_mount_opts *opts) {
+	struct fs_mount_opts defaults = {
+		.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+		.fat_cache_blocks = FS_FAT_CACHE_DEFAULT_BLOCKS,
+	};
+	if(opts == NULL){
+		opts = &defaults;
+	}
 
-	// BytesToRead = minimum of count and whats left of file 
-	size_t BytesLeftOfFile = rDir[RDIndex].fileSize - offset;
-	size_t BytesToRead = count;
-	if(BytesLeftOfFile < count){
-		BytesToRead = BytesLeftOfFile;
+	struct fs_ctx *ctx = calloc(1, sizeof(*ctx));
+	if(ctx == NULL){
+		return NULL;
+	}
+	pthread_rwlock_init(&ctx->metaLock, NULL);
+	pthread_mutex_init(&ctx->aioLock, NULL);
+	pthread_cond_init(&ctx->aioCond, NULL);
+	pthread_mutex_init(&ctx->traceLock, NULL);
+	pthread_mutex_init(&ctx->fatLock, NULL);
+	pthread_mutex_init(&ctx->freeMapLock, NULL);
+	ctx->aioThreads = opts->aio_threads;
+
+	ctx->disk = disk_open(diskname, opts->mmap_disk);
+	if(ctx->disk == NULL){
+		releaseCtx(ctx);
+		return NULL;
+	}
+	ctx->diskMapped = opts->mmap_disk;
+ 
+	bool supBvalid = disk_read(ctx->disk, 0, &ctx->supB) == 0 && 
+	 				 IsvalidSignature(&ctx->supB) && 
+	 				 ctx->supB.totBlocks == disk_count(ctx->disk);
+	ctx->numRDBs = ctx->supB.numRDBs ? ctx->supB.numRDBs : 1;
+	supBvalid = supBvalid &&
+					 ctx->supB.dataBStartIndex == ctx->supB.rootDirBlockIndex + ctx->numRDBs &&
+					 ctx->supB.dataBStartIndex + ctx->supB.numDblocks + ctx->supB.numJBs == ctx->supB.totBlocks;
+
+	if(!supBvalid){
+		releaseCtx(ctx);
+		return NULL;	
+	}
+
+	// Metadata committed before a crash is written in place before being read
+	if(ctx->supB.numJBs > 0){
+		size_t journalStart = ctx->supB.dataBStartIndex + ctx->supB.numDblocks;
+		ctx->journal = journal_open(ctx->disk, journalStart, ctx->supB.numJBs, journalStart);
+		if(ctx->journal == NULL){
+			releaseCtx(ctx);
+			return NULL;
+		}
 	}
 
-	int BytesCopied = 0;
-	int BytesToReadInBlock;
+	// FAT blocks are read when first needed
+	ctx->fatPages = calloc(ctx->supB.numFATBs, sizeof(*ctx->fatPages));
+	ctx->fatUsed = calloc(ctx->supB.numFATBs, sizeof(*ctx->fatUsed));
+	ctx->fatDirty = calloc(ctx->supB.numFATBs, sizeof(bool));
+	ctx->fatLogged = calloc(ctx->supB.numFATBs, sizeof(bool));
+	ctx->fatMax = opts->fat_cache_blocks;
+	if(ctx->fatPages == NULL || ctx->fatUsed == NULL || ctx->fatDirty == NULL || ctx->fatLogged == NULL){
+		releaseCtx(ctx);
+		return NULL;
+	}
 
-	// first block
-	if(BytesToRead > BLOCK_SIZE - relativeOffset){
-		BytesToReadInBlock = BLOCK_SIZE - relativeOffset;
-	} else {
-		BytesToReadInBlock = BytesToRead;
+	ctx->cacheBlocks = ctx->diskMapped ? 0 : opts->cache_blocks;
+	ctx->cache = cache_create(ctx->disk, ctx->cacheBlocks);
+	if(ctx->cache == NULL){
+		releaseCtx(ctx);
+		return NULL;
+	}
+
+	// copying over the root dir blocks
+	ctx->root = loadDir(ctx, NULL, -1, ctx->supB.rootDirBlockIndex, ctx->numRDBs);
+	if(ctx->root == NULL){
+		releaseCtx(ctx);
+		return NULL;
+	}
+
+	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
+		ctx->fdTable[i].dir = NULL;
+		pthread_mutex_init(&ctx->fdTable[i].lock, NULL);
 	}
 	
-	BytesCopied = dataBlockRead(currBlock, relativeOffset, BytesToReadInBlock, buf);
-	if(BytesCopied == -1){
-		return 0;  
+	return ctx;
+}
+
+int fs_ctx_umount(struct fs_ctx *ctx)
+{	
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
+		if(ctx->fdTable[i].dir != NULL){	// there are still open file descriptors
+			pthread_rwlock_unlock(&ctx->metaLock);
+			return -1;
+		}
 	}
-	BytesToRead -= BytesCopied;
-	buf_index += BytesCopied; 
-	currBlock = getNextBlock(currBlock, false);
 
-	// middle full blocks
-	while(BytesToRead >= BLOCK_SIZE){
-		BytesCopied = dataBlockRead(currBlock, 0, BLOCK_SIZE, &((uint8_t*)buf)[buf_index]);
-		if(BytesCopied == -1){
-			return buf_index;  
+	// Changes since the last sync only live in memory: if they cannot be
+	// written back, the file system stays mounted
+	disk_aio_drain(ctx->disk);	// asynchronous writes land before the cache's
+	int ret = cache_flush(ctx->cache);	// writes back the dirty data blocks
+	if(ret == 0 && ctx->journal == NULL){
+		ret = writeDirtyMetadata(ctx);	// directory files go through the cache
+	} else if(ret == 0 && 0 == (ret = syncMetadata(ctx))){
+		ret = checkpointMetadata(ctx);	// leaves the journal empty
+	}
+	if(ret == 0){
+		ret = cache_flush(ctx->cache);	// the directory blocks just written
+	}
+	pthread_rwlock_unlock(&ctx->metaLock);
+	if(ret == -1){
+		return -1;
+	}
+	cache_destroy(ctx->cache);	// nothing left to write back
+	ctx->cache = NULL;
+
+	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
+		pthread_mutex_destroy(&ctx->fdTable[i].lock);
+	}
+
+	disk_close(ctx->disk);
+	ctx->disk = NULL;
+	releaseCtx(ctx);
+	
+	return 0;
+}
+
+
+int fs_ctx_flush(struct fs_ctx *ctx)
+{
+	struct opCall call = opBegin(FS_OP_FLUSH, -1, 0, 0, NULL);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_rdlock(&ctx->metaLock);
+	int ret = cache_flush(ctx->cache);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int fs_ctx_sync(struct fs_ctx *ctx)
+{
+	struct opCall call = opBegin(FS_OP_SYNC, -1, 0, 0, NULL);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	disk_aio_drain(ctx->disk);
+	int ret = cache_flush(ctx->cache);
+	if(-1 == syncMetadata(ctx)){
+		ret = -1;
+	}
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int fs_ctx_info(struct fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_rdlock(&ctx->metaLock);
+	printf("FS Info:\n");
+	printf("total_blk_count=%d\n", ctx->supB.totBlocks);
+	printf("fat_blk_count=%d\n", ctx->supB.numFATBs);
+	printf("rdir_blk=%d\n", ctx->supB.rootDirBlockIndex);
+	printf("data_blk=%d\n", ctx->supB.dataBStartIndex);
+	printf("data_blk_count=%d\n", ctx->supB.numDblocks);
+	printf("fat_free_ratio=%d/%d\n",NumOfFreeFATs(ctx), ctx->supB.numDblocks);
+	printf("rdir_free_ratio=%d/%d\n",NumOfFreeRootEntries(ctx), ctx->root->numEntries);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return 0;
+}
+
+
+int createEntry(struct fs_ctx *ctx, const char *path, uint8_t type)
+{
+	char name[FS_FILENAME_LEN];
+	struct Directory *dir = resolveParent(ctx, path, name);
+	if(dir == NULL){
+		return -1;
+	}
+
+	if(nameidx_lookup(dir->names, name) != -1){	// if file already exists
+		return -1;
+	}
+
+	if(-1 == addEntry(ctx, dir, name, type)) {
+		return -1;
+	}
+	return 0;
+}
+
+int fs_ctx_create(struct fs_ctx *ctx, const char *filename)
+{
+	struct opCall call = opBegin(FS_OP_CREATE, -1, 0, 0, filename);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	int ret = createEntry(ctx, filename, ENTRY_FILE);
+	maybeSyncMetadata(ctx);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+int fs_ctx_mkdir(struct fs_ctx *ctx, const char *dirname)
+{
+	struct opCall call = opBegin(FS_OP_MKDIR, -1, 0, 0, dirname);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	int ret = createEntry(ctx, dirname, ENTRY_DIR);
+	maybeSyncMetadata(ctx);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+
+
+int deleteFile(struct fs_ctx *ctx, const char *filename)
+{
+	struct Directory *dir;
+	int entry = resolvePath(ctx, filename, ENTRY_FILE, &dir);
+	if(entry == -1){
+		return -1;
+	}
+
+	for(int i=0; i<FS_OPEN_MAX_COUNT; i++){
+		if(ctx->fdTable[i].dir == dir && ctx->fdTable[i].placeInDir == entry){
+			return -1;
+		}
+	}
+
+	// A write still in flight must not land in blocks reused by another file
+	disk_aio_drain(ctx->disk);
+	if(-1 == freeHoles(ctx, &dir->entries[entry])){
+		return -1;
+	}
+	int ret = freeChain(ctx, dir->entries[entry].firstDBIndex);
+	freeInline(dir, &dir->entries[entry]);
+	removeEntry(ctx, dir, entry);
+
+	return ret;
+}
+
+int fs_ctx_delete(struct fs_ctx *ctx, const char *filename)
+{
+	struct opCall call = opBegin(FS_OP_DELETE, -1, 0, 0, filename);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	int ret = deleteFile(ctx, filename);
+	maybeSyncMetadata(ctx);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+int removeDir(struct fs_ctx *ctx, const char *dirname)
+{
+	struct Directory *parent;
+	int entry = resolvePath(ctx, dirname, ENTRY_DIR, &parent);
+	if(entry == -1){
+		return -1;
+	}
+	struct Directory *dir = getSubdir(ctx, parent, entry);
+	if(dir == NULL || freemap_count_free(dir->freeEntries) != (size_t)dir->numEntries){	// not empty
+		return -1;
+	}
+
+	// Once freed, the directory's blocks may be reused for file data, which a
+	// replay of the journal must not overwrite
+	for(int i = 0; ctx->journal != NULL && i < dir->numBlocks; i++){
+		if(dir->logged[i]){
+			if(-1 == syncMetadata(ctx) || -1 == checkpointMetadata(ctx)){
+				return -1;
+			}
+			break;
+		}
+	}
+
+	int ret = freeChain(ctx, parent->entries[entry].firstDBIndex);
+	unloadDir(ctx, dir);
+	removeEntry(ctx, parent, entry);
+	return ret;
+}
+
+int fs_ctx_rmdir(struct fs_ctx *ctx, const char *dirname)
+{
+	struct opCall call = opBegin(FS_OP_RMDIR, -1, 0, 0, dirname);
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	int ret = removeDir(ctx, dirname);
+	maybeSyncMetadata(ctx);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
+
+void listDir(struct Directory *dir)
+{
+	printf("FS Ls:\n");
+	for(int i=0; i<dir->numEntries; i++){
+		struct RDentry *e = &dir->entries[i];
+		if(e->filename[0] != '\0'){
+			printf("%s: %s, size: %d, data_blk: %d\n", e->entryType == ENTRY_DIR ? "dir" : "file", e->filename, e->fileSize, e->firstDBIndex);
 		}
-		BytesToRead -= BytesCopied;
-		buf_index += BytesCopied; 
-		currBlock = getNextBlock(currBlock, false);
 	}
+}
+
+int fs_ctx_ls(struct fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_rdlock(&ctx->metaLock);
+	listDir(ctx->root);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return 0;
+}
+
+int fs_ctx_ls_dir(struct fs_ctx *ctx, const char *dirname)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	// may load directories
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	struct Directory *dir = ctx->root;
+	if(dirname != NULL && strcmp(dirname, "") != 0 && strcmp(dirname, "/") != 0){
+		struct Directory *parent;
+		int entry = resolvePath(ctx, dirname, ENTRY_DIR, &parent);
+		dir = entry == -1 ? NULL : getSubdir(ctx, parent, entry);
+	}
+	if(dir != NULL){
+		listDir(dir);
+	}
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return dir != NULL ? 0 : -1;
+}
+
+
+// phase 3
+
+int openFile(struct fs_ctx *ctx, const char *filename)
+{
+	// Find the first open FD in table
+	int fd = 0;
+	while(fd<FS_OPEN_MAX_COUNT && ctx->fdTable[fd].dir != NULL){
+		++fd;
+	}
+	if( fd >= FS_OPEN_MAX_COUNT) {	// there are already FS_OPEN_MAX_COUNT files currently open
+		return -1;
+	}
+
+	// Looking for filename in its directory
+	struct Directory *dir;
+	int entry = resolvePath(ctx, filename, ENTRY_FILE, &dir);
 
-	// last block
-	BytesCopied = dataBlockRead(currBlock, 0, BytesToRead, &((uint8_t*)buf)[buf_index]);
-	if(BytesCopied == -1){
-		return buf_index;  
+	if(entry == -1){	// File not found
+		return -1;
+	}
+	if(-1 == loadHoles(ctx, &dir->entries[entry])){
+		return -1;
+	}
+
+	// Store the file descriptor
+    ctx->fdTable[fd].offset = 0;
+	ctx->fdTable[fd].dir = dir;
+	ctx->fdTable[fd].placeInDir = entry;
+	ctx->fdTable[fd].cursorBlock = 0;
+	ctx->fdTable[fd].cursorDB = FAT_EOC;
+	ctx->fdTable[fd].raNext = 0;
+	ctx->fdTable[fd].raWindow = 0;
+	ctx->fdTable[fd].raBlock = 0;
+	ctx->fdTable[fd].advice = FS_ADVICE_NORMAL;
+    return fd;	// return the file descriptor (index in array)
+}
+
+int fs_ctx_open(struct fs_ctx *ctx, const char *filename)
+{
+	struct opCall call = opBegin(FS_OP_OPEN, -1, 0, 0, filename);
+	if(ctx == NULL){
+		return -1;
 	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	int ret = openFile(ctx, filename);
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return opEnd(ctx, &call, ret);
+}
 
-	fdTable[fd].offset +=  buf_index + BytesCopied;
-	return buf_index + BytesCopied;
+
+bool isFDValid(struct fs_ctx *ctx, int fd) {
+	return fd >= 0 && fd < FS_OPEN_MAX_COUNT && ctx->fdTable[fd].dir != NULL;
+}
+
+// Takes metaLock (shared or @exclusive) and the lock of @fd. Fails, holding
+// nothing, if no FS is mounted or @fd is not an open file descriptor.
+int lockFD(struct fs_ctx *ctx, int fd, bool exclusive) {
+	if(ctx == NULL){
+		return -1;
+	}
+	if(exclusive){
+		pthread_rwlock_wrlock(&ctx->metaLock);
+	} else {
+		pthread_rwlock_rdlock(&ctx->metaLock);
+	}
+	if(!isFDValid(ctx, fd)){
+		pthread_rwlock_unlock(&ctx->metaLock);
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->fdTable[fd].lock);
+	return 0;
+}
+
+void unlockFD(struct fs_ctx *ctx, int fd) {
+	pthread_mutex_unlock(&ctx->fdTable[fd].lock);
+	pthread_rwlock_unlock(&ctx->metaLock);
+}
+
+
+int fs_ctx_close(struct fs_ctx *ctx, int fd)
+{
+	struct opCall call = opBegin(FS_OP_CLOSE, fd, 0, 0, NULL);
+	if(lockFD(ctx, fd, true) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	ctx->fdTable[fd].dir = NULL;
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, 0);
+}
+
+
+int fs_ctx_stat(struct fs_ctx *ctx, int fd)
+{
+	struct opCall call = opBegin(FS_OP_STAT, fd, 0, 0, NULL);
+	if(lockFD(ctx, fd, false) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	int size = fileEntry(ctx, fd)->fileSize;
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, size);
+}
+
+
+int fs_ctx_lseek(struct fs_ctx *ctx, int fd, size_t offset)
+{
+	struct opCall call = opBegin(FS_OP_LSEEK, fd, offset, 0, NULL);
+	if(lockFD(ctx, fd, false) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	if(offset > UINT32_MAX) {	// past the largest file size
+		unlockFD(ctx, fd);
+		return opEnd(ctx, &call, -1);
+	}
+	ctx->fdTable[fd].offset = offset;
+	if(offset / BLOCK_SIZE < ctx->fdTable[fd].cursorBlock){	// cursor is past the new offset
+		ctx->fdTable[fd].cursorDB = FAT_EOC;
+	}
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, 0);
+}
+
+
+// phase 4
+
+// At the end of the chain, a non-zero @grow allocates an extent of up to @grow
+// blocks (what the caller still needs) instead of returning FAT_EOC.
+uint16_t getNextBlock(struct fs_ctx *ctx, uint16_t currBlock, size_t grow){
+	if(currBlock == FAT_EOC){
+		return FAT_EOC;
+	}
+	uint16_t next = getFAT(ctx, currBlock);
+	if(grow && next == FAT_EOC){
+		next = allocateExtent(ctx, currBlock, grow);
+	}
+	return next;
+}
+
+// Returns block @index of the fd's chain, or FAT_EOC if the chain is shorter
+// (FAT_ERROR if it cannot be read), walking the FAT from the fd's cursor when
+// possible
+uint16_t chainBlock(struct fs_ctx *ctx, int fd, size_t index){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	if(desc->cursorDB == FAT_EOC || index < desc->cursorBlock){
+		desc->cursorBlock = 0;
+		desc->cursorDB = fileEntry(ctx, fd)->firstDBIndex;
+	}
+	while(desc->cursorDB != FAT_EOC && desc->cursorBlock < index){
+		uint16_t next = getFAT(ctx, desc->cursorDB);
+		statAdd(&ctx->fatHops, 1);
+		if(chainStops(next)){
+			return next;
+		}
+		desc->cursorDB = next;
+		desc->cursorBlock++;
+	}
+	return desc->cursorDB;
+}
+
+// Returns the last block of the fd's chain (FAT_EOC if it is empty, FAT_ERROR
+// if it cannot be read), and sets @length to the number of blocks in the chain
+uint16_t chainEnd(struct fs_ctx *ctx, int fd, size_t *length){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	*length = 0;
+	uint16_t last = FAT_EOC;
+	uint16_t curr = fileEntry(ctx, fd)->firstDBIndex;
+	if(desc->cursorDB != FAT_EOC){
+		*length = desc->cursorBlock;
+		curr = desc->cursorDB;
+	}
+	while(curr != FAT_EOC){
+		if(curr == FAT_ERROR){
+			return FAT_ERROR;
+		}
+		last = curr;
+		(*length)++;
+		curr = getFAT(ctx, curr);
+	}
+	return last;
+}
+
+// Returns the data block holding @offset, walking the FAT from the fd's cursor
+// when possible, or HOLE_BLOCK if @offset lies in a hole (FAT_EOC past the end
+// of the chain, FAT_ERROR if it cannot be read). With a non-zero
+// @grow, missing blocks (and the first one) are allocated as extents of up to
+// @grow blocks. @run is set to the number of blocks from there to the next hole
+// boundary, which runs of blocks must not cross (SIZE_MAX if none).
+uint16_t findCurrBlock(struct fs_ctx *ctx, int fd, size_t offset, size_t *relativeOffset, size_t grow, size_t *run){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	struct RDentry *entry = fileEntry(ctx, fd);
+	size_t targetBlock;	// position in the chain
+	*relativeOffset = offset % BLOCK_SIZE;
+	if(holeLookup(fileHoles(ctx, entry), offset / BLOCK_SIZE, &targetBlock, run, NULL)){
+		return HOLE_BLOCK;
+	}
+
+	if(entry->firstDBIndex == FAT_EOC){
+		if(!grow){
+			return FAT_EOC;
+		}
+		entry->firstDBIndex = allocateExtent(ctx, FAT_EOC, grow);
+		if(entry->firstDBIndex == FAT_EOC){
+			return FAT_EOC;
+		}
+		markDirDirty(ctx, desc->dir, desc->placeInDir);
+	}
+
+	if(desc->cursorDB == FAT_EOC || targetBlock < desc->cursorBlock){
+		desc->cursorBlock = 0;
+		desc->cursorDB = entry->firstDBIndex;
+	}
+	uint64_t hops = 0;
+	while(desc->cursorBlock < targetBlock){
+		uint16_t next = getNextBlock(ctx, desc->cursorDB, grow);
+		hops++;
+		if(next == FAT_ERROR){
+			statAdd(&ctx->fatHops, hops);
+			return FAT_ERROR;
+		}
+		if(next == FAT_EOC){
+			break;
+		}
+		desc->cursorDB = next;
+		desc->cursorBlock++;
+	}
+	if(hops > 0){
+		statAdd(&ctx->fatHops, hops);
+	}
+	return desc->cursorBlock < targetBlock ? FAT_EOC : desc->cursorDB;
+}
+
+// Moves the fd's cursor over the blocks that physically follow it in the chain,
+// up to @maxBlocks blocks counting the current one. Returns the run length.
+size_t extendRun(struct fs_ctx *ctx, int fd, size_t maxBlocks, size_t grow){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	size_t run = 1;
+	while(run < maxBlocks){
+		uint16_t next = getNextBlock(ctx, desc->cursorDB, grow ? maxBlocks - run : 0);
+		if(next == FAT_EOC || next != desc->cursorDB + 1){
+			break;
+		}
+		desc->cursorDB = next;
+		desc->cursorBlock++;
+		run++;
+	}
+	return run;
+}
+
+// @keepOld tells whether bytes of the block outside the written range hold file
+// data; when they don't, the block is written without being read first.
+int dataBlockWrite(struct fs_ctx *ctx, int blockIndex, int startOffset, int byteCount, void* buf, bool keepOld) {
+	if(byteCount == 0){
+		return 0;
+	}
+	int ret;
+	if(keepOld){
+		ret = cache_write(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, startOffset, byteCount, buf);
+	} else {
+		ret = cache_overwrite(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, startOffset, byteCount, buf);
+	}
+	if(ret == -1){
+		return -1;
+	}
+	return byteCount;
+}
+
+// Allocates data blocks for blocks [@block, @block + @count) of the file,
+// which lie in one of its holes, and links them into the chain where they
+// belong. Returns how many were allocated, the first of which is stored in
+// @first: fewer than @count if the disk has no run that long, 0 if it is full
+// or if the hole would have to be split and the hole map is full.
+size_t fillHole(struct fs_ctx *ctx, int fd, size_t block, size_t count, uint16_t *first){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	struct RDentry *entry = fileEntry(ctx, fd);
+	struct HoleMap *map = fileHoles(ctx, entry);
+	size_t index, run;
+	uint32_t h;
+	holeLookup(map, block, &index, &run, &h);
+	struct Hole *hole = &map->data.holes[h];
+	bool full = map->data.numHoles == HOLES_PER_BLOCK;
+	if(full && block > hole->start && count < run){
+		return 0;
+	}
+
+	uint16_t prev = index > 0 ? chainBlock(ctx, fd, index - 1) : FAT_EOC;
+	uint16_t after = prev != FAT_EOC ? getFAT(ctx, prev) : entry->firstDBIndex;	// what the new blocks lead to
+	if((index > 0 && chainStops(prev)) || after == FAT_ERROR){
+		return 0;
+	}
+	*first = allocateExtent(ctx, FAT_EOC, count);
+	if(*first == FAT_EOC){
+		return 0;
+	}
+	size_t n = 1;
+	uint16_t last = *first;
+	for(uint16_t next = getFAT(ctx, last); !chainStops(next); next = getFAT(ctx, last)){
+		last = next;
+		n++;
+	}
+	if(full && block > hole->start && n < run){	// a shorter run than asked for
+		freeChain(ctx, *first);
+		return 0;
+	}
+
+	setFAT(ctx, last, after);
+	if(prev == FAT_EOC){
+		entry->firstDBIndex = *first;
+		markDirDirty(ctx, desc->dir, desc->placeInDir);
+	} else {
+		setFAT(ctx, prev, *first);
+	}
+
+	if(block == hole->start){
+		hole->start += n;
+		hole->len -= n;
+	} else if(n == run){
+		hole->len -= n;
+	} else {
+		memmove(&hole[2], &hole[1], (map->data.numHoles - h - 1) * sizeof(*hole));
+		hole[1].start = block + n;
+		hole[1].len = run - n;
+		hole->len = block - hole->start;
+		map->data.numHoles++;
+	}
+	if(hole->len == 0){
+		memmove(&hole[0], &hole[1], (map->data.numHoles - h - 1) * sizeof(*hole));
+		map->data.numHoles--;
+	}
+	markDirty(ctx, &map->dirty);
+
+	// Blocks from @index on moved down the chain
+	for(int i = 0; i < FS_OPEN_MAX_COUNT; i++){
+		struct fileDesc *other = &ctx->fdTable[i];
+		if(other->dir == desc->dir && other->placeInDir == desc->placeInDir && other->cursorBlock >= index){
+			other->cursorDB = FAT_EOC;
+		}
+	}
+	return n;
+}
+
+// Before a write at @offset, past the end of the file, makes what lies in
+// between read as zeros: blocks already allocated there (by fs_fallocate())
+// are zeroed, and those past the end of the chain become a hole, or are
+// allocated and zeroed without sparse files or if the hole map is full.
+int fillGap(struct fs_ctx *ctx, int fd, size_t offset){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	struct RDentry *entry = fileEntry(ctx, fd);
+	struct HoleMap *map = fileHoles(ctx, entry);
+	size_t length;
+	if(chainEnd(ctx, fd, &length) == FAT_ERROR){
+		return -1;
+	}
+	size_t end = length + holeBlocks(map);	// blocks the chain and holes span
+
+	size_t pos = entry->fileSize;
+	while(pos < offset && pos / BLOCK_SIZE < end){
+		size_t relativeOffset, run;
+		uint16_t block = findCurrBlock(ctx, fd, pos, &relativeOffset, 0, &run);
+		if(chainStops(block)){
+			return -1;
+		}
+		if(block == HOLE_BLOCK){
+			pos += run * BLOCK_SIZE - relativeOffset;
+			continue;
+		}
+		size_t len = BLOCK_SIZE - relativeOffset;
+		if(len > offset - pos){
+			len = offset - pos;
+		}
+		// only the block holding the end of the file has data to keep
+		if(-1 == dataBlockWrite(ctx, block, relativeOffset, len, (void *)zeroBlock, relativeOffset > 0)){
+			return -1;
+		}
+		pos += len;
+	}
+
+	size_t gapEnd = offset / BLOCK_SIZE;	// the write allocates the block holding @offset
+	if(gapEnd <= end){
+		return 0;
+	}
+	if(map == NULL && (ctx->supB.features & FEATURE_SPARSE)){
+		map = createHoles(ctx, desc->dir, desc->placeInDir);
+	}
+	if(map != NULL){
+		struct Hole *holes = map->data.holes;
+		uint32_t n = map->data.numHoles;
+		if(n > 0 && holes[n-1].start + holes[n-1].len == end){
+			holes[n-1].len += gapEnd - end;
+			markDirty(ctx, &map->dirty);
+			return 0;
+		}
+		if(n < HOLES_PER_BLOCK){
+			holes[n] = (struct Hole){ end, gapEnd - end };
+			map->data.numHoles++;
+			markDirty(ctx, &map->dirty);
+			return 0;
+		}
+	}
+
+	for(size_t block = end; block < gapEnd; block++){
+		size_t relativeOffset, run;
+		uint16_t curr = findCurrBlock(ctx, fd, block * BLOCK_SIZE, &relativeOffset, gapEnd - block, &run);
+		if(chainStops(curr) || curr == HOLE_BLOCK ||
+		   -1 == dataBlockWrite(ctx, curr, 0, BLOCK_SIZE, (void *)zeroBlock, false)){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Drops one reference to @req, which completes it when it was the last one.
+void putAioRequest(struct fs_ctx *ctx, struct aioRequest *req, bool failed){
+	pthread_mutex_lock(&ctx->aioLock);
+	if(failed){
+		req->failed = true;
+	}
+	if(--req->pending == 0){
+		if(req->failed){
+			req->result = -1;
+		}
+		if(ctx->aioDoneTail != NULL){
+			ctx->aioDoneTail->next = req;
+		} else {
+			ctx->aioDone = req;
+		}
+		ctx->aioDoneTail = req;
+		pthread_cond_broadcast(&ctx->aioCond);
+	}
+	pthread_mutex_unlock(&ctx->aioLock);
+}
+
+// Argument of the disk completion callback: a disk request only knows one pointer
+struct aioSegment {
+	struct fs_ctx *ctx;
+	struct aioRequest *req;
+	bool write;
+};
+
+void aioSegmentDone(void *arg, long res){
+	struct aioSegment *seg = arg;
+	if(seg->write){
+		cache_note_write(seg->ctx->cache);	// a readahead may predate it
+	}
+	putAioRequest(seg->ctx, seg->req, res < 0);
+	free(seg);
+}
+
+// Queues a disk request for @req. Whole blocks bypass the cache, which only
+// has to forget (write) or give up (read) its own copies of them.
+int dataBlocksAsync(struct fs_ctx *ctx, size_t block, size_t blockCount, void *buf, bool write, struct aioRequest *req){
+	struct aioSegment *seg = malloc(sizeof(*seg));
+	if(seg == NULL){
+		return -1;
+	}
+	seg->ctx = ctx;
+	seg->req = req;
+	seg->write = write;
+
+	int ret;
+	pthread_mutex_lock(&ctx->aioLock);
+	req->pending++;
+	pthread_mutex_unlock(&ctx->aioLock);
+	if(write){
+		cache_update_range(ctx->cache, block, blockCount, buf);
+		ret = disk_write_async(ctx->disk, block, blockCount, buf, aioSegmentDone, seg);
+	} else {
+		ret = cache_flush_range(ctx->cache, block, blockCount);
+		if(ret == 0){
+			ret = disk_read_async(ctx->disk, block, blockCount, buf, aioSegmentDone, seg);
+		}
+	}
+	if(ret == -1){
+		free(seg);
+		pthread_mutex_lock(&ctx->aioLock);
+		req->pending--;
+		pthread_mutex_unlock(&ctx->aioLock);
+		return -1;
+	}
+	return blockCount * BLOCK_SIZE;
+}
+
+// With a non-NULL @req, the blocks are written asynchronously on behalf of it
+int dataBlocksWrite(struct fs_ctx *ctx, int blockIndex, size_t blockCount, void* buf, struct aioRequest *req) {
+	if(req != NULL){
+		return dataBlocksAsync(ctx, blockIndex+ctx->supB.dataBStartIndex, blockCount, buf, true, req);
+	}
+	if(-1 == cache_write_range(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, blockCount, buf)){
+		return -1;
+	}
+	return blockCount * BLOCK_SIZE;
+}
+
+
+// With a non-NULL @req, whole blocks are written asynchronously on behalf of
+// it, and only partial blocks go through the cache before returning.
+int writeFile(struct fs_ctx *ctx, int fd, void *buf, size_t count, struct aioRequest *req)
+{
+	if(count == 0){
+		return 0;
+	}
+
+	struct RDentry *entry = fileEntry(ctx, fd);
+	size_t offset = ctx->fdTable[fd].offset;
+	size_t buf_index = 0;
+	if(count > UINT32_MAX - offset){	// past the largest file size
+		count = UINT32_MAX - offset;
+	}
+
+	// A small file stays in its directory entry, or leaves it for good
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	bool empty = entry->fileSize == 0 && entry->firstDBIndex == FAT_EOC && entry->holeMap == 0;
+	if((ctx->supB.features & FEATURE_INLINE) && (entry->inlineEntries > 0 || empty) &&
+	   offset + count <= INLINE_MAX && 0 == growInline(ctx, desc->dir, desc->placeInDir, offset + count)){
+		if(offset > entry->fileSize){
+			writeInline(ctx, desc->dir, entry, entry->fileSize, NULL, offset - entry->fileSize);
+		}
+		writeInline(ctx, desc->dir, entry, offset, buf, count);
+		desc->offset += count;
+		if(desc->offset > entry->fileSize){
+			entry->fileSize = desc->offset;
+			markDirDirty(ctx, desc->dir, desc->placeInDir);
+		}
+		return count;
+	}
+	if(entry->inlineEntries > 0 && -1 == spillInline(ctx, desc->dir, desc->placeInDir)){
+		return 0;
+	}
+
+	if(offset > entry->fileSize && -1 == fillGap(ctx, fd, offset)){
+		return 0;
+	}
+
+	size_t endBlock = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	bool failed = false;	// the FAT could not be read
+
+	while(buf_index < count){
+		// blocks this write still spans, so the chain grows by whole extents
+		size_t grow = endBlock - (offset + buf_index) / BLOCK_SIZE;
+		size_t relativeOffset, untilHole;
+		uint16_t currBlock = findCurrBlock(ctx, fd, offset + buf_index, &relativeOffset, grow, &untilHole);
+		if(currBlock == HOLE_BLOCK){
+			size_t block = (offset + buf_index) / BLOCK_SIZE;
+			uint16_t first;
+			size_t n = fillHole(ctx, fd, block, grow < untilHole ? grow : untilHole, &first);
+			if(n == 0){
+				break;
+			}
+			// Bytes of the new blocks that this write leaves alone read as zeros
+			size_t end = offset + count;
+			if(relativeOffset > 0 && -1 == dataBlockWrite(ctx, first, 0, BLOCK_SIZE, (void *)zeroBlock, false)){
+				break;
+			}
+			if(end % BLOCK_SIZE != 0 && end < (block + n) * BLOCK_SIZE &&
+			   -1 == dataBlockWrite(ctx, first + end / BLOCK_SIZE - block, 0, BLOCK_SIZE, (void *)zeroBlock, false)){
+				break;
+			}
+			continue;
+		}
+		if(currBlock == FAT_ERROR){
+			failed = true;
+			break;
+		}
+		if(currBlock == FAT_EOC){	// disk is full
+			break;
+		}
+
+		// Whole blocks that are contiguous on disk go out in one request
+		if(relativeOffset == 0 && count - buf_index >= (req ? 1 : 2)*BLOCK_SIZE){
+			size_t maxBlocks = (count - buf_index) / BLOCK_SIZE;
+			size_t run = extendRun(ctx, fd, maxBlocks < untilHole ? maxBlocks : untilHole, grow);
+			if(run > 1 || req != NULL){
+				int BytesWritten = dataBlocksWrite(ctx, currBlock, run, &((uint8_t*)buf)[buf_index], req);
+				if(BytesWritten == -1){
+					break;
+				}
+				buf_index += BytesWritten;
+				continue;
+			}
+		}
+
+		size_t byteCount = count - buf_index;
+		if(byteCount > BLOCK_SIZE - relativeOffset){
+			byteCount = BLOCK_SIZE - relativeOffset;
+		}
+
+		// Only a write that leaves some of the block's existing data in place
+		// needs the old content
+		size_t blockStart = offset + buf_index - relativeOffset;
+		size_t existing = 0;
+		if(entry->fileSize > blockStart){
+			existing = entry->fileSize - blockStart;
+		}
+		bool keepOld = existing > 0 && (relativeOffset > 0 || byteCount < existing);
+		// Past a gap, the start of the block is part of it
+		if(existing == 0 && relativeOffset > 0 &&
+		   -1 == dataBlockWrite(ctx, currBlock, 0, relativeOffset, (void *)zeroBlock, false)){
+			break;
+		}
+
+		int BytesWritten = dataBlockWrite(ctx, currBlock, relativeOffset, byteCount, &((uint8_t*)buf)[buf_index], keepOld);
+		if(BytesWritten == -1){
+			break;
+		}
+		buf_index += BytesWritten;
+	}
+
+	ctx->fdTable[fd].offset += buf_index;
+
+	// A write past the end that stored nothing leaves the size alone: a gap
+	// recorded as a hole lies past the end until data follows it
+	if(buf_index > 0 && ctx->fdTable[fd].offset > entry->fileSize){
+		entry->fileSize = ctx->fdTable[fd].offset;
+		markDirDirty(ctx, ctx->fdTable[fd].dir, ctx->fdTable[fd].placeInDir);
+	}
+
+	return failed && buf_index == 0 ? -1 : (int)buf_index;
+}
+
+int fs_ctx_write(struct fs_ctx *ctx, int fd, void *buf, size_t count)
+{
+	struct opCall call = opBegin(FS_OP_WRITE, fd, 0, count, NULL);
+	if(buf==NULL || lockFD(ctx, fd, true) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	call.offset = ctx->fdTable[fd].offset;
+	int ret = writeFile(ctx, fd, buf, count, NULL);
+	maybeSyncMetadata(ctx);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int dataBlockRead(struct fs_ctx *ctx, int blockIndex, int startOffset, int byteCount, void* buf) {
+	if(byteCount == 0){
+		return 0;
+	}
+	int ret;
+	if(startOffset == 0 && byteCount == BLOCK_SIZE){	// whole block lands directly in buf
+		ret = cache_read_through(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, buf);
+	} else {
+		ret = cache_read(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, startOffset, byteCount, buf);
+	}
+	if(ret == -1){
+		return -1;
+	}
+	return byteCount;
+}
+
+// With a non-NULL @req, the blocks are read asynchronously on behalf of it
+int dataBlocksRead(struct fs_ctx *ctx, int blockIndex, size_t blockCount, void* buf, struct aioRequest *req) {
+	if(req != NULL){
+		return dataBlocksAsync(ctx, blockIndex+ctx->supB.dataBStartIndex, blockCount, buf, false, req);
+	}
+	if(-1 == cache_read_range(ctx->cache, blockIndex+ctx->supB.dataBStartIndex, blockCount, buf)){
+		return -1;
+	}
+	return blockCount * BLOCK_SIZE;
+}
+
+
+// Reads blocks [@first, @last) of the file into the cache in the background,
+// with one request per run of contiguous blocks. The fd's cursor is left alone.
+void prefetchBlocks(struct fs_ctx *ctx, int fd, size_t first, size_t last){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	if(disk_aio_start(ctx->disk, ctx->aioThreads) == -1){
+		return;
+	}
+
+	// Positions in the chain of the blocks that are not in holes
+	struct HoleMap *map = fileHoles(ctx, fileEntry(ctx, fd));
+	size_t run;
+	holeLookup(map, first, &first, &run, NULL);
+	holeLookup(map, last, &last, &run, NULL);
+
+	size_t block = 0;
+	uint16_t curr = fileEntry(ctx, fd)->firstDBIndex;
+	if(desc->cursorDB != FAT_EOC && desc->cursorBlock <= first){
+		block = desc->cursorBlock;
+		curr = desc->cursorDB;
+	}
+	while(!chainStops(curr) && block < first){
+		curr = getFAT(ctx, curr);
+		block++;
+	}
+
+	while(!chainStops(curr) && block < last){
+		uint16_t runStart = curr;
+		size_t run = 0;
+		while(curr != FAT_EOC && block < last && curr == runStart + run){
+			curr = getFAT(ctx, curr);
+			block++;
+			run++;
+		}
+		if(-1 == cache_prefetch(ctx->cache, runStart+ctx->supB.dataBStartIndex, run)){
+			return;
+		}
+	}
+}
+
+// Called after a read of @count bytes at @offset. The window doubles while
+// reads follow each other and halves on every other read; blocks up to a
+// window past the reader are prefetched, in batches of half a window or more.
+void readAhead(struct fs_ctx *ctx, int fd, size_t offset, size_t count){
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	size_t maxWindow = ctx->cacheBlocks / 4;
+	if(maxWindow > RA_MAX_BLOCKS){
+		maxWindow = RA_MAX_BLOCKS;
+	}
+	if(maxWindow == 0 || desc->advice == FS_ADVICE_RANDOM){
+		return;
+	}
+
+	if(desc->advice == FS_ADVICE_SEQUENTIAL){
+		desc->raWindow = maxWindow;
+	} else if(offset == desc->raNext){
+		desc->raWindow = desc->raWindow ? 2*desc->raWindow : RA_MIN_BLOCKS;
+		if(desc->raWindow > maxWindow){
+			desc->raWindow = maxWindow;
+		}
+	} else {
+		desc->raWindow /= 2;
+		desc->raBlock = 0;
+	}
+	desc->raNext = offset + count;
+	if(desc->raWindow == 0){
+		return;
+	}
+
+	size_t fileBlocks = (fileEntry(ctx, fd)->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t next = desc->raNext / BLOCK_SIZE;
+	size_t target = next + desc->raWindow;
+	if(target > fileBlocks){
+		target = fileBlocks;
+	}
+	size_t first = desc->raBlock > next ? desc->raBlock : next;
+	if(first >= target || (target - first < desc->raWindow / 2 && target < fileBlocks)){
+		return;
+	}
+	prefetchBlocks(ctx, fd, first, target);
+	desc->raBlock = target;
+}
+
+// Same as writeFile() for @req
+int readFile(struct fs_ctx *ctx, int fd, void *buf, size_t count, struct aioRequest *req)
+{
+	if(count == 0){
+		return 0;
+	}
+
+	struct RDentry *entry = fileEntry(ctx, fd);
+	size_t offset = ctx->fdTable[fd].offset;
+	if(offset >= entry->fileSize){	// possibly past it, after fs_lseek()
+		return 0;
+	}
+
+	// BytesToRead = minimum of count and whats left of file 
+	size_t BytesLeftOfFile = entry->fileSize - offset;
+	size_t BytesToRead = count;
+	if(BytesLeftOfFile < count){
+		BytesToRead = BytesLeftOfFile;
+	}
+
+	if(entry->inlineEntries > 0){	// straight from the directory
+		readInline(ctx->fdTable[fd].dir, entry, offset, buf, BytesToRead);
+		ctx->fdTable[fd].offset += BytesToRead;
+		return BytesToRead;
+	}
+
+	size_t buf_index = 0;
+	bool failed = false;	// the FAT could not be read
+
+	while(buf_index < BytesToRead){
+		size_t relativeOffset, untilHole;
+		uint16_t currBlock = findCurrBlock(ctx, fd, offset + buf_index, &relativeOffset, 0, &untilHole);
+		if(currBlock == HOLE_BLOCK){	// zeros, without any I/O
+			size_t len = untilHole * BLOCK_SIZE - relativeOffset;
+			if(len > BytesToRead - buf_index){
+				len = BytesToRead - buf_index;
+			}
+			memset(&((uint8_t*)buf)[buf_index], 0, len);
+			buf_index += len;
+			continue;
+		}
+		if(currBlock == FAT_ERROR){
+			failed = true;
+			break;
+		}
+		if(currBlock == FAT_EOC){
+			break;
+		}
+
+		// Whole blocks that are contiguous on disk come in with one request
+		if(relativeOffset == 0 && BytesToRead - buf_index >= (req ? 1 : 2)*BLOCK_SIZE){
+			size_t maxBlocks = (BytesToRead - buf_index) / BLOCK_SIZE;
+			size_t run = extendRun(ctx, fd, maxBlocks < untilHole ? maxBlocks : untilHole, 0);
+			if(run > 1 || req != NULL){
+				int BytesCopied = dataBlocksRead(ctx, currBlock, run, &((uint8_t*)buf)[buf_index], req);
+				if(BytesCopied == -1){
+					break;
+				}
+				buf_index += BytesCopied;
+				continue;
+			}
+		}
+
+		size_t BytesToReadInBlock = BytesToRead - buf_index;
+		if(BytesToReadInBlock > BLOCK_SIZE - relativeOffset){
+			BytesToReadInBlock = BLOCK_SIZE - relativeOffset;
+		}
+
+		int BytesCopied = dataBlockRead(ctx, currBlock, relativeOffset, BytesToReadInBlock, &((uint8_t*)buf)[buf_index]);
+		if(BytesCopied == -1){
+			break;
+		}
+		buf_index += BytesCopied;
+	}
+
+	ctx->fdTable[fd].offset += buf_index;
+	if(failed && buf_index == 0){
+		return -1;
+	}
+	if(req == NULL){
+		readAhead(ctx, fd, offset, buf_index);
+	}
+	return buf_index;
+}
+
+int fs_ctx_read(struct fs_ctx *ctx, int fd, void *buf, size_t count)
+{
+	struct opCall call = opBegin(FS_OP_READ, fd, 0, count, NULL);
+	if(buf==NULL || lockFD(ctx, fd, false) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	call.offset = ctx->fdTable[fd].offset;
+	int ret = readFile(ctx, fd, buf, count, NULL);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int reserveBlocks(struct fs_ctx *ctx, int fd, size_t len)
+{
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	struct RDentry *entry = fileEntry(ctx, fd);
+	size_t needed = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if(entry->inlineEntries > 0 && len > entry->fileSize && -1 == spillInline(ctx, desc->dir, desc->placeInDir)){
+		return -1;
+	}
+
+	// Holes stay holes: only what lies past them and the chain is allocated
+	size_t have;
+	uint16_t last = chainEnd(ctx, fd, &have);
+	if(last == FAT_ERROR){
+		return -1;
+	}
+	have += holeBlocks(fileHoles(ctx, entry));
+
+	if(have >= needed){
+		return 0;
+	}
+	if((size_t)NumOfFreeFATs(ctx) < needed - have){
+		return -1;
+	}
+
+	while(have < needed){
+		uint16_t first = allocateExtent(ctx, last, needed - have);
+		if(first == FAT_EOC){
+			return -1;
+		}
+		if(entry->firstDBIndex == FAT_EOC){
+			entry->firstDBIndex = first;
+		}
+		for(last = first; !chainStops(getFAT(ctx, last)); last = getFAT(ctx, last)){
+			have++;
+		}
+		have++;
+	}
+
+	markDirDirty(ctx, desc->dir, desc->placeInDir);
+	return 0;
+}
+
+int fs_ctx_fallocate(struct fs_ctx *ctx, int fd, size_t len)
+{
+	struct opCall call = opBegin(FS_OP_FALLOCATE, fd, 0, len, NULL);
+	if(lockFD(ctx, fd, true) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	int ret = reserveBlocks(ctx, fd, len);
+	maybeSyncMetadata(ctx);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int syncFile(struct fs_ctx *ctx, int fd)
+{
+	disk_aio_drain(ctx->disk);
+	int ret = 0;
+	uint16_t block = fileEntry(ctx, fd)->firstDBIndex;
+	while(block != FAT_EOC){
+		if(block == FAT_ERROR){
+			ret = -1;
+			break;
+		}
+		if(-1 == cache_flush_block(ctx->cache, block+ctx->supB.dataBStartIndex)){
+			ret = -1;
+		}
+		block = getFAT(ctx, block);
+	}
+	// FAT and root directory blocks are shared by all files
+	if(-1 == syncMetadata(ctx)){
+		ret = -1;
+	}
+	return ret;
+}
+
+int fs_ctx_fsync(struct fs_ctx *ctx, int fd)
+{
+	struct opCall call = opBegin(FS_OP_FSYNC, fd, 0, 0, NULL);
+	if(lockFD(ctx, fd, true) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	int ret = syncFile(ctx, fd);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int readFileView(struct fs_ctx *ctx, int fd, size_t count, struct fs_view *views, int max_views)
+{
+	struct RDentry *entry = fileEntry(ctx, fd);
+	if(!ctx->diskMapped || entry->inlineEntries > 0){
+		return -1;
+	}
+
+	size_t offset = ctx->fdTable[fd].offset;
+	if(offset >= entry->fileSize){
+		return 0;
+	}
+
+	size_t BytesLeftOfFile = entry->fileSize - offset;
+	size_t BytesToRead = count;
+	if(BytesLeftOfFile < count){
+		BytesToRead = BytesLeftOfFile;
+	}
+
+	size_t covered = 0;
+	int numViews = 0;
+
+	while(numViews < max_views && covered < BytesToRead){
+		size_t relativeOffset, untilHole;
+		uint16_t currBlock = findCurrBlock(ctx, fd, offset + covered, &relativeOffset, 0, &untilHole);
+		if(currBlock == FAT_ERROR && numViews == 0){
+			return -1;
+		}
+		if(chainStops(currBlock)){
+			break;
+		}
+
+		// one view per run of contiguous blocks, and per block of a hole
+		size_t left = BytesToRead - covered;
+		size_t spanned = (relativeOffset + left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t run = 1;
+		const uint8_t *data = zeroBlock;
+		if(currBlock != HOLE_BLOCK){
+			run = extendRun(ctx, fd, spanned < untilHole ? spanned : untilHole, 0);
+			data = disk_view(ctx->disk, currBlock+ctx->supB.dataBStartIndex, run);
+		}
+		if(data == NULL){
+			break;
+		}
+
+		size_t len = run * BLOCK_SIZE - relativeOffset;
+		if(len > left){
+			len = left;
+		}
+		views[numViews].data = data + relativeOffset;
+		views[numViews].len = len;
+		numViews++;
+		covered += len;
+	}
+
+	ctx->fdTable[fd].offset += covered;
+	return numViews;
+}
+
+int fs_ctx_read_view(struct fs_ctx *ctx, int fd, size_t count, struct fs_view *views, int max_views)
+{
+	struct opCall call = opBegin(FS_OP_READ_VIEW, fd, 0, count, NULL);
+	if(views==NULL || lockFD(ctx, fd, false) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	call.offset = ctx->fdTable[fd].offset;
+	int ret = readFileView(ctx, fd, count, views, max_views);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int adviseFile(struct fs_ctx *ctx, int fd, int advice)
+{
+	struct fileDesc *desc = &ctx->fdTable[fd];
+	struct RDentry *entry = fileEntry(ctx, fd);
+	size_t fileBlocks = (entry->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	switch(advice){
+	case FS_ADVICE_NORMAL:
+	case FS_ADVICE_SEQUENTIAL:
+	case FS_ADVICE_RANDOM:
+		desc->advice = advice;
+		desc->raWindow = 0;
+		desc->raBlock = 0;
+		return 0;
+	case FS_ADVICE_WILLNEED: {
+		size_t first = desc->offset / BLOCK_SIZE;
+		size_t last = first + RA_MAX_BLOCKS;
+		if(last > fileBlocks){
+			last = fileBlocks;
+		}
+		if(ctx->cacheBlocks > 0 && first < last){
+			prefetchBlocks(ctx, fd, first, last);
+		}
+		return 0;
+	}
+	case FS_ADVICE_DONTNEED: {
+		uint16_t block = entry->firstDBIndex;
+		while(!chainStops(block)){
+			cache_drop_range(ctx->cache, block+ctx->supB.dataBStartIndex, 1);
+			block = getFAT(ctx, block);
+		}
+		desc->raBlock = 0;	// prefetched blocks may be gone
+		return 0;
+	}
+	default:
+		return -1;
+	}
+}
+
+int fs_ctx_advise(struct fs_ctx *ctx, int fd, int advice)
+{
+	struct opCall call = opBegin(FS_OP_ADVISE, fd, 0, advice, NULL);
+	if(lockFD(ctx, fd, false) == -1){
+		return opEnd(ctx, &call, -1);
+	}
+	int ret = adviseFile(ctx, fd, advice);
+	unlockFD(ctx, fd);
+	return opEnd(ctx, &call, ret);
+}
+
+
+int submitAsync(struct fs_ctx *ctx, struct opCall *call, int fd, void *buf, size_t count, void *user_data)
+{
+	bool write = call->op == FS_OP_WRITE_ASYNC;
+	if(buf==NULL || lockFD(ctx, fd, write) == -1){
+		return -1;
+	}
+	struct aioRequest *req = calloc(1, sizeof(*req));
+	if(req == NULL || disk_aio_start(ctx->disk, ctx->aioThreads) == -1){
+		unlockFD(ctx, fd);
+		free(req);
+		return -1;
+	}
+	req->userData = user_data;
+	req->pending = 1;
+	pthread_mutex_lock(&ctx->aioLock);
+	ctx->aioOutstanding++;
+	pthread_mutex_unlock(&ctx->aioLock);
+
+	call->offset = ctx->fdTable[fd].offset;
+	if(write){
+		req->result = writeFile(ctx, fd, buf, count, req);
+		maybeSyncMetadata(ctx);
+	} else {
+		req->result = readFile(ctx, fd, buf, count, req);
+	}
+	if(req->result > 0){
+		statAdd(&ctx->opStats[call->op].bytes, req->result);
+	}
+	unlockFD(ctx, fd);
+
+	// Everything queued by this request goes to the disk in one batch
+	disk_aio_submit(ctx->disk);
+	putAioRequest(ctx, req, false);
+	return 0;
+}
+
+int fs_ctx_read_async(struct fs_ctx *ctx, int fd, void *buf, size_t count, void *user_data)
+{
+	struct opCall call = opBegin(FS_OP_READ_ASYNC, fd, 0, count, NULL);
+	return opEnd(ctx, &call, submitAsync(ctx, &call, fd, buf, count, user_data));
+}
+
+int fs_ctx_write_async(struct fs_ctx *ctx, int fd, void *buf, size_t count, void *user_data)
+{
+	struct opCall call = opBegin(FS_OP_WRITE_ASYNC, fd, 0, count, NULL);
+	return opEnd(ctx, &call, submitAsync(ctx, &call, fd, buf, count, user_data));
+}
+
+int fs_ctx_aio_wait(struct fs_ctx *ctx, struct fs_completion *events, int min, int max)
+{
+	if(ctx == NULL || events == NULL){
+		return -1;
+	}
+	int reaped = 0;
+	pthread_mutex_lock(&ctx->aioLock);
+	while(reaped < max){
+		struct aioRequest *req = ctx->aioDone;
+		if(req != NULL){
+			ctx->aioDone = req->next;
+			if(ctx->aioDone == NULL){
+				ctx->aioDoneTail = NULL;
+			}
+			ctx->aioOutstanding--;
+			events[reaped].user_data = req->userData;
+			events[reaped].ret = req->result;
+			free(req);
+			reaped++;
+			continue;
+		}
+		if(reaped >= min || ctx->aioOutstanding == 0){
+			break;
+		}
+		pthread_cond_wait(&ctx->aioCond, &ctx->aioLock);
+	}
+	pthread_mutex_unlock(&ctx->aioLock);
+	return reaped;
+}
+
+
+// Blocks copied with one read and one write by the defragmenter
+#define DEFRAG_BATCH 256
+
+// Walks the chain of @entry, storing up to @max blocks in @blocks (if not
+// NULL). Returns its length (SIZE_MAX if the FAT cannot be read), and sets
+// @runs to the number of contiguous runs.
+size_t chainLayout(struct fs_ctx *ctx, const struct RDentry *entry, uint16_t *blocks, size_t max, size_t *runs){
+	size_t len = 0;
+	*runs = 0;
+	uint16_t prev = FAT_EOC;
+	for(uint16_t block = entry->firstDBIndex; block != FAT_EOC && len < ctx->supB.numDblocks; block = getFAT(ctx, block)){
+		if(block == FAT_ERROR){
+			return SIZE_MAX;
+		}
+		if(prev == FAT_EOC || block != prev + 1){
+			(*runs)++;
+		}
+		if(blocks != NULL && len < max){
+			blocks[len] = block;
+		}
+		prev = block;
+		len++;
+	}
+	return len;
+}
+
+// Finds the first file of @dir or its subdirectories (depth first) spread over
+// several runs for which a free run can hold all its blocks, and reserves it
+// as the file's new place.
+bool startDefrag(struct fs_ctx *ctx, struct Directory *dir){
+	for(int i = 0; i < dir->numEntries; i++){
+		struct RDentry *e = &dir->entries[i];
+		if(e->filename[0] == '\0'){
+			continue;
+		}
+		if(e->entryType == ENTRY_DIR){
+			struct Directory *sub = getSubdir(ctx, dir, i);
+			if(sub != NULL && startDefrag(ctx, sub)){
+				return true;
+			}
+			continue;
+		}
+		size_t runs;
+		size_t len = chainLayout(ctx, e, NULL, 0, &runs);
+		if(len == SIZE_MAX || runs < 2){
+			continue;
+		}
+		size_t got;
+		size_t first = freemap_alloc_run(ctx->freeMap, len, 0, &got);	// block 0 is never free
+		if(first == FREEMAP_FULL){
+			return false;
+		}
+		if(got < len){	// no room for it in one run
+			for(size_t b = first; b < first + got; b++){
+				freemap_set_free(ctx->freeMap, b);
+			}
+			continue;
+		}
+		ctx->defragDir = dir;
+		ctx->defragEntry = i;
+		ctx->defragTarget = first;
+		ctx->defragLen = len;
+		ctx->defragDone = 0;
+		return true;
+	}
+	return false;
+}
+
+// Moves the next blocks (at most @budget) of the file being defragmented to its
+// new run, linking them in place of the old ones, which are freed. The file is
+// consistent on disk between two calls, and may change in between (it is given
+// up if its first blocks moved). Returns the number of blocks moved, 0 if the
+// file was given up.
+int stepDefrag(struct fs_ctx *ctx, size_t budget){
+	struct Directory *dir = ctx->defragDir;
+	struct RDentry *e = &dir->entries[ctx->defragEntry];
+	size_t done = ctx->defragDone;
+	size_t n = ctx->defragLen - done;
+	if(n > budget){
+		n = budget;
+	}
+	if(n > DEFRAG_BATCH){
+		n = DEFRAG_BATCH;
+	}
+
+	// The blocks already moved must still start the chain
+	uint16_t *chain = malloc((done + n) * sizeof(*chain));
+	uint8_t *buf = malloc(n * BLOCK_SIZE);
+	if(chain == NULL || buf == NULL){
+		free(chain);
+		free(buf);
+		return -1;
+	}
+	size_t runs;
+	size_t len = e->filename[0] != '\0' && e->entryType != ENTRY_DIR ? chainLayout(ctx, e, chain, done + n, &runs) : 0;
+	bool valid = len != SIZE_MAX && len >= done + n;
+	for(size_t i = 0; valid && i < done; i++){
+		valid = chain[i] == ctx->defragTarget + i;
+	}
+	if(!valid){
+		free(chain);
+		free(buf);
+		endDefrag(ctx);
+		return 0;
+	}
+
+	// Copy the data, in one read per run of old blocks and one write
+	const uint16_t *old = &chain[done];
+	size_t dataStart = ctx->supB.dataBStartIndex;
+	uint16_t target = ctx->defragTarget + done;
+	int ret = 0;
+	for(size_t i = 0; ret == 0 && i < n;){
+		size_t start = i++;
+		while(i < n && old[i] == old[i-1] + 1){
+			i++;
+		}
+		ret = cache_read_range(ctx->cache, old[start] + dataStart, i - start, &buf[start * BLOCK_SIZE]);
+	}
+	if(ret == 0){
+		ret = cache_write_range(ctx->cache, target + dataStart, n, buf);
+	}
+	// With a journal, the copy is durable before the FAT points to it
+	if(ret == 0 && ctx->journal != NULL){
+		ret = disk_sync(ctx->disk);
+	}
+	free(buf);
+	if(ret == -1){
+		free(chain);
+		endDefrag(ctx);
+		return -1;
+	}
+
+	uint16_t rest = getFAT(ctx, old[n-1]);
+	if(rest == FAT_ERROR){
+		free(chain);
+		endDefrag(ctx);
+		return -1;
+	}
+	for(size_t i = 0; i < n; i++){
+		setFAT(ctx, target + i, i + 1 < n ? target + i + 1 : rest);
+	}
+	if(done == 0){
+		e->firstDBIndex = target;
+		markDirDirty(ctx, dir, ctx->defragEntry);
+	} else {
+		setFAT(ctx, target - 1, target);
+	}
+	for(size_t i = 0; i < n; i++){
+		setFAT(ctx, old[i], 0);
+		freemap_set_free(ctx->freeMap, old[i]);
+		cache_drop_range(ctx->cache, old[i] + dataStart, 1);
+	}
+	free(chain);
+
+	// Descriptors on the file must not follow the old chain
+	for(int fd = 0; fd < FS_OPEN_MAX_COUNT; fd++){
+		if(ctx->fdTable[fd].dir == dir && ctx->fdTable[fd].placeInDir == ctx->defragEntry){
+			ctx->fdTable[fd].cursorDB = FAT_EOC;
+			ctx->fdTable[fd].raBlock = 0;
+		}
+	}
+
+	ctx->defragDone += n;
+	if(ctx->defragDone == ctx->defragLen){
+		ctx->defragDir = NULL;
+	}
+	return n;
+}
+
+int fs_ctx_defrag(struct fs_ctx *ctx, size_t budget)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_rwlock_wrlock(&ctx->metaLock);
+	disk_aio_drain(ctx->disk);	// no write in flight to a block being moved
+	if(getFreeMap(ctx) == NULL){
+		pthread_rwlock_unlock(&ctx->metaLock);
+		return -1;
+	}
+	size_t moved = 0;
+	int ret = 0;
+	while(moved < budget && moved < INT_MAX){
+		if(ctx->defragDir == NULL && !startDefrag(ctx, ctx->root)){
+			break;
+		}
+		ret = stepDefrag(ctx, budget - moved);
+		if(ret == -1){
+			break;
+		}
+		moved += ret;
+		// Freed blocks may be reused by the next file, or by anyone once
+		// the lock is released: the new chain must be committed first
+		if(ret > 0 && ctx->journal != NULL && syncMetadata(ctx) == -1){
+			ret = -1;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return ret == -1 ? -1 : (int)moved;
+}
+
+
+int fs_ctx_stats(struct fs_ctx *ctx, struct fs_stats *stats)
+{
+	if(ctx == NULL || stats == NULL){
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	for(int op = 0; op < FS_OP_COUNT; op++){
+		const uint64_t *src = (const uint64_t *)&ctx->opStats[op];
+		uint64_t *dst = (uint64_t *)&stats->ops[op];
+		for(size_t i = 0; i < sizeof(stats->ops[op]) / sizeof(uint64_t); i++){
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+	}
+	stats->fat_hops = __atomic_load_n(&ctx->fatHops, __ATOMIC_RELAXED);
+	stats->journal_commits = __atomic_load_n(&ctx->journalCommits, __ATOMIC_RELAXED);
+
+	struct disk_stats ds;
+	disk_get_stats(ctx->disk, &ds);
+	stats->block_reads = ds.block_reads;
+	stats->block_writes = ds.block_writes;
+	stats->read_requests = ds.read_requests;
+	stats->write_requests = ds.write_requests;
+	stats->disk_syncs = ds.syncs;
+
+	unsigned long hits, misses;
+	cache_stats(ctx->cache, &hits, &misses);
+	stats->cache_hits = hits;
+	stats->cache_misses = misses;
+
+	pthread_rwlock_rdlock(&ctx->metaLock);
+	stats->alloc_scans = ctx->freeMap != NULL ? freemap_scans(ctx->freeMap) : 0;
+	pthread_rwlock_unlock(&ctx->metaLock);
+	return 0;
+}
+
+int fs_ctx_trace_start(struct fs_ctx *ctx, const char *filename)
+{
+	if(ctx == NULL || filename == NULL){
+		return -1;
+	}
+	int ret = -1;
+	pthread_mutex_lock(&ctx->traceLock);
+	if(ctx->trace == NULL){
+		struct trace *trace = trace_open(filename, statClock());
+		if(trace != NULL){
+			__atomic_store_n(&ctx->trace, trace, __ATOMIC_RELEASE);
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&ctx->traceLock);
+	return ret;
+}
+
+int fs_ctx_trace_stop(struct fs_ctx *ctx)
+{
+	if(ctx == NULL){
+		return -1;
+	}
+	pthread_mutex_lock(&ctx->traceLock);
+	struct trace *trace = ctx->trace;
+	__atomic_store_n(&ctx->trace, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ctx->traceLock);
+	return trace == NULL ? -1 : trace_close(trace);
+}
+
+const char *fs_op_name(int op)
+{
+	if(op < 0 || op >= FS_OP_COUNT){
+		return NULL;
+	}
+	return opNames[op];
+}
+
+
+int fs_format(const char *diskname, size_t data_blocks, const struct fs_format_opts *opts)
+{
+	static const struct fs_format_opts defaultFormat = {1, 0, 0, 0};
+	if(opts == NULL){
+		opts = &defaultFormat;
+	}
+	size_t rootBlocks = opts->root_blocks ? opts->root_blocks : 1;
+	size_t fatBlocks = (data_blocks * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t total = 1 + fatBlocks + rootBlocks + data_blocks + opts->journal_blocks;
+	if(data_blocks == 0 || data_blocks > FAT_EOC || total > UINT16_MAX ||
+	   (opts->journal_blocks > 0 && opts->journal_blocks < 3)){
+		return -1;
+	}
+
+	// The superblock and the first FAT block are consecutive: one write
+	uint8_t *meta = calloc(2, BLOCK_SIZE);
+	if(meta == NULL){
+		return -1;
+	}
+	struct SuperBlock *supB = (struct SuperBlock *)meta;
+	supB->features = (opts->sparse_files ? FEATURE_SPARSE : 0) | (opts->inline_files ? FEATURE_INLINE : 0);
+	memcpy(&supB->signature, supB->features ? FEATURES_SIGNATURE : SIGNATURE, 8);
+	supB->totBlocks = total;
+	supB->rootDirBlockIndex = 1 + fatBlocks;
+	supB->dataBStartIndex = 1 + fatBlocks + rootBlocks;
+	supB->numDblocks = data_blocks;
+	supB->numFATBs = fatBlocks;
+	supB->numRDBs = rootBlocks > 1 ? rootBlocks : 0;	// 0 as on reference images
+	supB->numJBs = opts->journal_blocks;
+	uint16_t *FAT = (uint16_t *)(meta + BLOCK_SIZE);
+	FAT[0] = FAT_EOC;	// data block 0 is never allocated
+
+	struct disk *disk = NULL;
+	int ret = disk_create(diskname, total);
+	if(ret == 0){
+		disk = disk_open(diskname, 0);
+		ret = disk == NULL ? -1 : disk_write_range(disk, 0, 2, meta);
+	}
+	if(ret == 0 && opts->journal_blocks > 0){
+		ret = journal_format(disk, supB->dataBStartIndex + data_blocks, opts->journal_blocks);
+	}
+	if(ret == 0){
+		ret = disk_sync(disk);
+	}
+	if(disk != NULL){
+		disk_close(disk);
+	}
+	free(meta);
+	return ret;
+}
+
+// Takes the journal out of the last data blocks, which must be free
+int addJournal(struct disk *disk, size_t blocks)
+{
+	struct SuperBlock supB;
+	if(-1 == disk_read(disk, 0, &supB) || !IsvalidSignature(&supB) || supB.totBlocks != disk_count(disk)){
+		return -1;
+	}
+	if(supB.numJBs != 0 || blocks < 3 || blocks >= supB.numDblocks){
+		return -1;
+	}
+
+	uint16_t *FAT = malloc(supB.numFATBs * BLOCK_SIZE);
+	if(FAT == NULL){
+		return -1;
+	}
+	int ret = disk_read_range(disk, 1, supB.numFATBs, FAT);
+	for(size_t i = supB.numDblocks - blocks; ret == 0 && i < supB.numDblocks; i++){
+		if(FAT[i] != 0){
+			ret = -1;
+		}
+	}
+	free(FAT);
+	if(ret == -1){
+		return -1;
+	}
+
+	supB.numDblocks -= blocks;
+	supB.numJBs = blocks;
+	if(-1 == journal_format(disk, supB.dataBStartIndex + supB.numDblocks, blocks) ||
+	   -1 == disk_sync(disk) || -1 == disk_write(disk, 0, &supB)){
+		return -1;
+	}
+	return disk_sync(disk);
+}
+
+int fs_mkjournal(const char *diskname, size_t blocks)
+{
+	struct disk *disk = disk_open(diskname, 0);
+	if(disk == NULL){
+		return -1;
+	}
+	int ret = addJournal(disk, blocks);
+	disk_close(disk);
+	return ret;
+}
+
+
+// Consistency checker. Works on an unmounted image: directories are read
+// first, then the chains of the files are walked by several threads, each
+// data block being claimed by the first entry that reaches it.
+
+struct checkDir {
+	struct RDentry *entries;
+	int numEntries;
+	size_t *diskBlocks;
+	int numBlocks;
+	char *path;	// "" for the root directory
+	bool dirty;	// an entry was repaired
+};
+
+struct checkEntry {
+	struct checkDir *dir;
+	int entry;
+};
+
+struct checker {
+	struct disk *disk;
+	struct SuperBlock supB;
+	uint16_t *FAT;
+	bool *fatDirty;	// one flag per FAT block
+	uint32_t *owner;	// 1 + number of the entry owning each data block, 0 if none
+	struct checkDir **dirs;
+	size_t numDirs;
+	struct checkEntry *entries;	// directories and files
+	size_t numEntries;
+	size_t *files;	// entries walked by the worker threads
+	size_t numFiles;
+	size_t nextFile;	// next one to walk, taken atomically
+	const struct fs_check_opts *opts;
+	struct fs_check_report *report;	// counters updated atomically
+	pthread_mutex_t printLock;
+};
+
+struct RDentry *checkedEntry(struct checker *chk, size_t id){
+	return &chk->entries[id].dir->entries[chk->entries[id].entry];
+}
+
+void checkProblem(struct checker *chk, size_t id, size_t *counter, const char *fmt, size_t a, size_t b){
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+	if(!chk->opts->verbose){
+		return;
+	}
+	pthread_mutex_lock(&chk->printLock);
+	printf("%s/%s: ", chk->entries[id].dir->path, (const char *)checkedEntry(chk, id)->filename);
+	printf(fmt, a, b);
+	printf("%s\n", chk->opts->repair ? " (repaired)" : "");
+	pthread_mutex_unlock(&chk->printLock);
+}
+
+void checkSetFAT(struct checker *chk, size_t block, uint16_t value){
+	chk->FAT[block] = value;
+	__atomic_store_n(&chk->fatDirty[block / FAT_PER_BLOCK], true, __ATOMIC_RELAXED);
+}
+
+// Claims the hole map of file entry @id and copies it to @holes. A map that is
+// out of range, free, already claimed or malformed, or on a file system
+// without sparse files, is a bad pointer; with repair, the file loses it, so
+// that the blocks after each hole move up.
+void checkHoles(struct checker *chk, size_t id, struct HoleBlock *holes){
+	struct RDentry *e = checkedEntry(chk, id);
+	size_t block = e->holeMap;
+	uint32_t claimed = 0;
+	bool valid = (chk->supB.features & FEATURE_SPARSE) && block < chk->supB.numDblocks &&
+		     __atomic_compare_exchange_n(&chk->owner[block], &claimed, id + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	bool owned = valid;
+	valid = valid && chk->FAT[block] == FAT_EOC &&
+		0 == disk_read(chk->disk, block + chk->supB.dataBStartIndex, holes) &&
+		holes->numHoles <= HOLES_PER_BLOCK;
+	uint64_t end = 0;
+	for(uint32_t i = 0; valid && i < holes->numHoles; i++){
+		valid = holes->holes[i].len > 0 && holes->holes[i].start >= end;
+		end = (uint64_t)holes->holes[i].start + holes->holes[i].len;
+	}
+	if(valid){
+		return;
+	}
+	checkProblem(chk, id, &chk->report->bad_pointers, "hole map %zu is invalid (%zu holes)", block, owned ? holes->numHoles : 0);
+	holes->numHoles = 0;
+	if(chk->opts->repair){
+		if(owned){	// left for the pass over the FAT to free
+			__atomic_store_n(&chk->owner[block], 0, __ATOMIC_RELAXED);
+		}
+		e->holeMap = 0;
+		chk->entries[id].dir->dirty = true;
+	}
+}
+
+// Follows the chain of entry @id, claiming its blocks, up to the first block
+// that is out of range, free, or already claimed (a cross-link, or a cycle if
+// claimed by @id itself). With repair, the chain is cut there. Returns the
+// number of blocks kept, the first @max of which are stored in @blocks.
+size_t walkChain(struct checker *chk, size_t id, uint16_t *blocks, size_t max){
+	struct fs_check_report *report = chk->report;
+	struct RDentry *e = checkedEntry(chk, id);
+	uint16_t prev = FAT_EOC;
+	uint16_t block = e->firstDBIndex;
+	size_t len = 0;
+	while(block != FAT_EOC){
+		size_t *counter = NULL;
+		const char *what = NULL;
+		uint32_t claimed = 0;
+		if(block == 0 || block >= chk->supB.numDblocks){
+			counter = &report->bad_pointers;
+			what = "block %zu of the chain is %zu, out of range";
+		} else if(!__atomic_compare_exchange_n(&chk->owner[block], &claimed, id + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+			counter = claimed == id + 1 ? &report->cycles : &report->cross_links;
+			what = claimed == id + 1 ? "block %zu of the chain loops back to %zu" : "block %zu of the chain, %zu, belongs to another entry";
+		} else if(chk->FAT[block] == 0){
+			__atomic_store_n(&chk->owner[block], 0, __ATOMIC_RELAXED);
+			counter = &report->bad_pointers;
+			what = "block %zu of the chain, %zu, is free";
+		}
+		if(counter != NULL){
+			checkProblem(chk, id, counter, what, len, block);
+			if(chk->opts->repair && prev == FAT_EOC){
+				e->firstDBIndex = FAT_EOC;
+				chk->entries[id].dir->dirty = true;
+			} else if(chk->opts->repair){
+				checkSetFAT(chk, prev, FAT_EOC);
+			}
+			break;
+		}
+		if(len < max){
+			blocks[len] = block;
+		}
+		len++;
+		prev = block;
+		block = chk->FAT[block];
+	}
+
+	// Blocks in holes need no room in the chain
+	struct HoleBlock holes;
+	holes.numHoles = 0;
+	if(e->entryType != ENTRY_DIR && e->holeMap != 0){
+		checkHoles(chk, id, &holes);
+	}
+	size_t size = e->inlineEntries > 0 ? 0 : ((size_t)e->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;	// inline data needs no block
+	size_t need = size;
+	size_t end = len;	// blocks the chain and the holes before its end span
+	for(uint32_t i = 0; i < holes.numHoles; i++){
+		size_t start = holes.holes[i].start;
+		size_t stop = start + holes.holes[i].len;
+		if(start < size){
+			need -= (stop < size ? stop : size) - start;
+		}
+		if(start < end){
+			end += holes.holes[i].len;
+		}
+	}
+	if(len < need){	// longer chains hold blocks reserved by fs_fallocate()
+		checkProblem(chk, id, &report->size_mismatches, "size needs %zu blocks, the chain has %zu", need, len);
+		if(chk->opts->repair){
+			e->fileSize = end * BLOCK_SIZE;
+			chk->entries[id].dir->dirty = true;
+		}
+	}
+	return len < need ? len : need;
+}
+
+void *checkWorker(void *arg){
+	struct checker *chk = arg;
+	size_t i;
+	while((i = __atomic_fetch_add(&chk->nextFile, 1, __ATOMIC_RELAXED)) < chk->numFiles){
+		walkChain(chk, chk->files[i], NULL, 0);
+	}
+	return NULL;
+}
+
+// Checks the inline data of entry @id: the file system must have inline files,
+// and its entries must lie in the directory, hold the whole file, look unused,
+// and belong to no other file (@taken marks those seen so far). With repair, a
+// file failing this loses its inline data.
+void checkInline(struct checker *chk, size_t id, bool *taken){
+	struct checkDir *dir = chk->entries[id].dir;
+	struct RDentry *e = checkedEntry(chk, id);
+	size_t first = e->inlineEntry;
+	size_t count = e->inlineEntries;
+	bool valid = (chk->supB.features & FEATURE_INLINE) && e->entryType != ENTRY_DIR && e->firstDBIndex == FAT_EOC && e->holeMap == 0 &&
+		     count <= INLINE_MAX_ENTRIES && first + count <= (size_t)dir->numEntries && e->fileSize <= count * INLINE_BYTES;
+	for(size_t i = 0; valid && i < count; i++){
+		valid = !taken[first + i] && dir->entries[first + i].filename[0] == '\0';
+	}
+	if(valid){
+		memset(&taken[first], true, count);
+		return;
+	}
+	checkProblem(chk, id, &chk->report->bad_pointers, "inline data in %zu entries from %zu is invalid", count, first);
+	if(chk->opts->repair){
+		e->inlineEntries = 0;	// its size is then checked against its chain
+		dir->dirty = true;
+	}
+}
+
+// Adds the used entries of @dir to the entries to check
+int addCheckEntries(struct checker *chk, struct checkDir *dir){
+	struct checkEntry *entries = realloc(chk->entries, (chk->numEntries + dir->numEntries) * sizeof(*entries));
+	size_t *files = realloc(chk->files, (chk->numEntries + dir->numEntries) * sizeof(*files));
+	if(entries != NULL){
+		chk->entries = entries;
+	}
+	if(files != NULL){
+		chk->files = files;
+	}
+	if(entries == NULL || files == NULL){
+		return -1;
+	}
+	size_t added = 0;
+	for(int i = 0; i < dir->numEntries; i++){
+		if(dir->entries[i].filename[0] != '\0'){
+			added++;
+			chk->entries[chk->numEntries] = (struct checkEntry){ dir, i };
+			if(dir->entries[i].entryType != ENTRY_DIR){
+				chk->files[chk->numFiles++] = chk->numEntries;
+			}
+			chk->numEntries++;
+		}
+	}
+
+	bool *taken = calloc(dir->numEntries ? dir->numEntries : 1, sizeof(bool));
+	if(taken == NULL){
+		return -1;
+	}
+	for(size_t id = chk->numEntries - added; id < chk->numEntries; id++){
+		if(checkedEntry(chk, id)->inlineEntries > 0){
+			checkInline(chk, id, taken);
+		}
+	}
+	free(taken);
+	return 0;
+}
+
+// Reads directory @name of @parent (the root directory if @parent is NULL),
+// whose blocks are the data blocks @blocks (from disk block @first onwards for
+// the root directory), and queues it
+struct checkDir *readCheckDir(struct checker *chk, const struct checkDir *parent, const char *name, const uint16_t *blocks, size_t first, int numBlocks){
+	struct checkDir *dir = calloc(1, sizeof(*dir));
+	struct checkDir **dirs = realloc(chk->dirs, (chk->numDirs + 1) * sizeof(*dirs));
+	if(dirs != NULL){
+		chk->dirs = dirs;
+	}
+	if(dir == NULL || dirs == NULL){
+		free(dir);
+		return NULL;
+	}
+	chk->dirs[chk->numDirs++] = dir;
+	dir->path = malloc(parent != NULL ? strlen(parent->path) + FS_FILENAME_LEN + 1 : 1);
+	if(dir->path != NULL){
+		sprintf(dir->path, "%s%s%s", parent != NULL ? parent->path : "", parent != NULL ? "/" : "", name);
+	}
+	dir->numBlocks = numBlocks;
+	dir->numEntries = numBlocks * ENTRIES_PER_BLOCK;
+	dir->diskBlocks = malloc((numBlocks ? numBlocks : 1) * sizeof(size_t));
+	dir->entries = malloc((numBlocks ? numBlocks : 1) * BLOCK_SIZE);
+	if(dir->path == NULL || dir->diskBlocks == NULL || dir->entries == NULL){
+		return NULL;
+	}
+	for(int i = 0; i < numBlocks; i++){
+		dir->diskBlocks[i] = blocks != NULL ? blocks[i] + chk->supB.dataBStartIndex : first + i;
+		if(-1 == disk_read(chk->disk, dir->diskBlocks[i], &dir->entries[i*ENTRIES_PER_BLOCK])){
+			return NULL;
+		}
+	}
+	return dir;
+}
+
+void freeChecker(struct checker *chk){
+	for(size_t i = 0; i < chk->numDirs; i++){
+		free(chk->dirs[i]->entries);
+		free(chk->dirs[i]->diskBlocks);
+		free(chk->dirs[i]->path);
+		free(chk->dirs[i]);
+	}
+	free(chk->dirs);
+	free(chk->entries);
+	free(chk->files);
+	free(chk->owner);
+	free(chk->fatDirty);
+	free(chk->FAT);
+	pthread_mutex_destroy(&chk->printLock);
+	if(chk->disk != NULL){
+		disk_close(chk->disk);
+	}
+}
+
+int runChecker(struct checker *chk){
+	struct fs_check_report *report = chk->report;
+	struct SuperBlock *supB = &chk->supB;
+	if(-1 == disk_read(chk->disk, 0, supB)){
+		return -1;
+	}
+	size_t numRDBs = supB->numRDBs ? supB->numRDBs : 1;
+	if(!IsvalidSignature(supB) || supB->totBlocks != disk_count(chk->disk) ||
+	   supB->dataBStartIndex != supB->rootDirBlockIndex + numRDBs ||
+	   supB->dataBStartIndex + supB->numDblocks + supB->numJBs != supB->totBlocks){
+		return -1;
+	}
+	// Committed metadata is written in place first, as when mounting
+	if(supB->numJBs > 0){
+		size_t journalStart = supB->dataBStartIndex + supB->numDblocks;
+		struct journal *j = journal_open(chk->disk, journalStart, supB->numJBs, journalStart);
+		if(j == NULL){
+			return -1;
+		}
+		journal_close(j);
+	}
+
+	// The whole FAT comes in with one request
+	chk->FAT = malloc(supB->numFATBs * BLOCK_SIZE);
+	chk->fatDirty = calloc(supB->numFATBs, sizeof(bool));
+	chk->owner = calloc(supB->numDblocks, sizeof(uint32_t));
+	uint16_t *blocks = malloc(supB->numDblocks * sizeof(uint16_t));
+	int ret = -1;
+	if(chk->FAT == NULL || chk->fatDirty == NULL || chk->owner == NULL || blocks == NULL ||
+	   -1 == disk_read_range(chk->disk, 1, supB->numFATBs, chk->FAT)){
+		free(blocks);
+		return -1;
+	}
+
+	// Directories, breadth first; a directory is only read through its
+	// valid blocks, so that damaged ones cannot lead astray
+	struct checkDir *root = readCheckDir(chk, NULL, "", NULL, supB->rootDirBlockIndex, numRDBs);
+	if(root == NULL || -1 == addCheckEntries(chk, root)){
+		goto out;
+	}
+	for(size_t id = 0; id < chk->numEntries; id++){
+		struct RDentry *e = checkedEntry(chk, id);
+		if(e->entryType != ENTRY_DIR){
+			continue;
+		}
+		size_t len = walkChain(chk, id, blocks, supB->numDblocks);
+		char name[FS_FILENAME_LEN];
+		memcpy(name, e->filename, FS_FILENAME_LEN);
+		name[FS_FILENAME_LEN - 1] = '\0';
+		struct checkDir *dir = readCheckDir(chk, chk->entries[id].dir, name, blocks, 0, len);
+		if(dir == NULL || -1 == addCheckEntries(chk, dir)){
+			goto out;
+		}
+	}
+	report->dirs = chk->numDirs;
+	report->files = chk->numFiles;
+
+	// Files, in parallel
+	long threads = chk->opts->threads;
+	if(threads <= 0){
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(threads < 1 || (size_t)threads > chk->numFiles){
+		threads = chk->numFiles ? (long)chk->numFiles : 1;
+	}
+	pthread_t *tids = malloc(threads * sizeof(*tids));
+	long started = 0;
+	while(tids != NULL && started < threads - 1 && 0 == pthread_create(&tids[started], NULL, checkWorker, chk)){
+		started++;
+	}
+	checkWorker(chk);
+	for(long i = 0; i < started; i++){
+		pthread_join(tids[i], NULL);
+	}
+	free(tids);
+
+	// One pass over the FAT: blocks no entry claimed must be free, and are
+	// exactly what the free map holds
+	if(chk->FAT[0] != FAT_EOC){
+		report->orphans++;
+		if(chk->opts->repair){
+			checkSetFAT(chk, 0, FAT_EOC);
+		}
+	}
+	for(size_t b = 1; b < supB->numDblocks; b++){
+		if(chk->owner[b] != 0){
+			report->used_blocks++;
+			continue;
+		}
+		report->free_blocks++;
+		if(chk->FAT[b] != 0){
+			report->orphans++;
+			if(chk->opts->repair){
+				checkSetFAT(chk, b, 0);
+			}
+		}
+	}
+
+	ret = 0;
+	if(chk->opts->repair){
+		for(int i = 0; ret == 0 && i < supB->numFATBs; i++){
+			if(chk->fatDirty[i]){
+				ret = disk_write(chk->disk, 1 + i, &chk->FAT[i * FAT_PER_BLOCK]);
+			}
+		}
+		for(size_t d = 0; ret == 0 && d < chk->numDirs; d++){
+			for(int i = 0; ret == 0 && chk->dirs[d]->dirty && i < chk->dirs[d]->numBlocks; i++){
+				ret = disk_write(chk->disk, chk->dirs[d]->diskBlocks[i], &chk->dirs[d]->entries[i*ENTRIES_PER_BLOCK]);
+			}
+		}
+		if(ret == 0){
+			ret = disk_sync(chk->disk);
+		}
+	}
+out:
+	free(blocks);
+	return ret;
+}
+
+int fs_check(const char *diskname, const struct fs_check_opts *opts, struct fs_check_report *report)
+{
+	static const struct fs_check_opts defaultCheck = {0, 0, 0};
+	if(report == NULL){
+		return -1;
+	}
+	if(opts == NULL){
+		opts = &defaultCheck;
+	}
+	memset(report, 0, sizeof(*report));
+
+	struct checker chk;
+	memset(&chk, 0, sizeof(chk));
+	chk.opts = opts;
+	chk.report = report;
+	pthread_mutex_init(&chk.printLock, NULL);
+	chk.disk = disk_open(diskname, 0);
+	int ret = chk.disk == NULL ? -1 : runChecker(&chk);
+	freeChecker(&chk);
+	if(ret == -1){
+		return -1;
+	}
+	return report->bad_pointers + report->cycles + report->cross_links + report->orphans + report->size_mismatches;
+}
+
+
+// Functions working on the default context
+
+int fs_mount(const char *diskname) {
+	return fs_mount_ex(diskname, NULL);
+}
+
+int fs_mount_ex(const char *diskname, const struct fs_mount_opts *opts) {
+	pthread_rwlock_wrlock(&defaultLock);
+	int ret = -1;
+	if(defaultCtx == NULL){
+		defaultCtx = fs_ctx_mount(diskname, opts);
+		if(defaultCtx != NULL){
+			// Lets unmodified programs capture their traffic
+			const char *trace = getenv("FS_TRACE");
+			if(trace != NULL && trace[0] != '\0'){
+				fs_ctx_trace_start(defaultCtx, trace);
+			}
+			ret = 0;
+		}
+	}
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_umount(void)
+{
+	pthread_rwlock_wrlock(&defaultLock);
+	int ret = fs_ctx_umount(defaultCtx);
+	if(ret == 0){
+		defaultCtx = NULL;
+	}
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_flush(void)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_flush(defaultCtx);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_sync(void)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_sync(defaultCtx);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_info(void)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_info(defaultCtx);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_create(defaultCtx, filename);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_delete(defaultCtx, filename);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_ls(void)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_ls(defaultCtx);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_mkdir(const char *dirname)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_mkdir(defaultCtx, dirname);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_rmdir(const char *dirname)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_rmdir(defaultCtx, dirname);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_ls_dir(const char *dirname)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_ls_dir(defaultCtx, dirname);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_open(const char *filename)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_open(defaultCtx, filename);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_close(defaultCtx, fd);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_stat(defaultCtx, fd);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_lseek(defaultCtx, fd, offset);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_write(defaultCtx, fd, buf, count);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_read(defaultCtx, fd, buf, count);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_fallocate(int fd, size_t len)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_fallocate(defaultCtx, fd, len);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_fsync(int fd)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_fsync(defaultCtx, fd);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_read_view(int fd, size_t count, struct fs_view *views, int max_views)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_read_view(defaultCtx, fd, count, views, max_views);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_read_async(int fd, void *buf, size_t count, void *user_data)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_read_async(defaultCtx, fd, buf, count, user_data);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_write_async(int fd, void *buf, size_t count, void *user_data)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_write_async(defaultCtx, fd, buf, count, user_data);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_aio_wait(struct fs_completion *events, int min, int max)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_aio_wait(defaultCtx, events, min, max);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_advise(int fd, int advice)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_advise(defaultCtx, fd, advice);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_defrag(size_t budget)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_defrag(defaultCtx, budget);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_stats(struct fs_stats *stats)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_stats(defaultCtx, stats);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_trace_start(const char *filename)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_trace_start(defaultCtx, filename);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
+}
+
+int fs_trace_stop(void)
+{
+	pthread_rwlock_rdlock(&defaultLock);
+	int ret = fs_ctx_trace_stop(defaultCtx);
+	pthread_rwlock_unlock(&defaultLock);
+	return ret;
 }
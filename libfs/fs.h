@@ -1,21 +1,282 @@
 #ifndef _FS_H
 #define _FS_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
- */
-
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * This header used to be a fixed contract. It now also declares extensions:
+ * mount and format options, caching and sync, directories, asynchronous I/O,
+ * statistics, tracing and checking. The original functions keep their
+ * signatures, and their behavior on images they could already handle.
+ *
+ * All functions below can be called from several threads at once. Reads on
+ * different file descriptors run in parallel; operations that change the file
+ * system layout (create, delete, write, ...) are serialized.
+ *
+ * The fs_*() functions work on a single, process-wide mounted file system.
+ * The fs_ctx_*() functions at the end of this file do the same on a file
+ * system designated by a handle, so that a process can mount any number of
+ * virtual disks at once. Operations on different handles are independent.
+ *
+ * Files are designated by paths: names separated by '/' (a leading '/' is
+ * optional), each of them at most %FS_FILENAME_LEN characters long including
+ * the NULL character. Every name but the last one designates a directory,
+ * starting from the root directory.
+ */
 
-/** Maximum filename length (including the NULL character) */
+/** Maximum length of a name in a path (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/**
+ * Number of files in a root directory of one block. The root directory can
+ * span several blocks (as recorded in the superblock), holding this many files
+ * per block.
+ */
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Number of blocks cached in memory when mounting with fs_mount() */
+#define FS_CACHE_DEFAULT_BLOCKS 256
+
+/** Number of FAT blocks kept in memory when mounting with fs_mount() */
+#define FS_FAT_CACHE_DEFAULT_BLOCKS 8
+
+/**
+ * Group commit thresholds of the journal: changed metadata blocks are committed
+ * once this many of them are waiting, or once the oldest one has waited this
+ * many milliseconds
+ */
+#define FS_JOURNAL_COMMIT_BLOCKS 16
+#define FS_JOURNAL_COMMIT_MS 100
+
+/** Access pattern hints for fs_advise() */
+#define FS_ADVICE_NORMAL 0
+#define FS_ADVICE_SEQUENTIAL 1
+#define FS_ADVICE_RANDOM 2
+#define FS_ADVICE_WILLNEED 3
+#define FS_ADVICE_DONTNEED 4
+
+/** Operations counted by fs_stats(), indexes in &struct fs_stats.ops */
+#define FS_OP_CREATE 0
+#define FS_OP_DELETE 1
+#define FS_OP_MKDIR 2
+#define FS_OP_RMDIR 3
+#define FS_OP_OPEN 4
+#define FS_OP_CLOSE 5
+#define FS_OP_STAT 6
+#define FS_OP_LSEEK 7
+#define FS_OP_READ 8
+#define FS_OP_WRITE 9
+#define FS_OP_FALLOCATE 10
+#define FS_OP_FSYNC 11
+#define FS_OP_SYNC 12
+#define FS_OP_FLUSH 13
+#define FS_OP_READ_VIEW 14
+#define FS_OP_ADVISE 15
+#define FS_OP_READ_ASYNC 16
+#define FS_OP_WRITE_ASYNC 17
+#define FS_OP_COUNT 18
+
+/**
+ * Number of buckets in a latency histogram. Bucket i counts the calls that took
+ * from 2^i to 2^(i+1) nanoseconds; the last one also counts longer calls.
+ */
+#define FS_STATS_BUCKETS 32
+
+/** First bytes of a trace file written by fs_trace_start() ("FSTRACE\0") */
+#define FS_TRACE_MAGIC 0x0045434152545346ULL
+#define FS_TRACE_VERSION 1
+
+/**
+ * struct fs_mount_opts - Mount options
+ * @cache_blocks: Number of data blocks kept in the write-back block cache (0
+ *                disables caching)
+ * @mmap_disk: Map the virtual disk file in memory instead of using read and
+ *             write system calls. The block cache is then disabled (the kernel
+ *             page cache plays its role) and fs_read_view() becomes available.
+ * @aio_threads: Carry out fs_read_async() and fs_write_async() requests with
+ *               worker threads even where io_uring is available
+ * @fat_cache_blocks: Number of FAT blocks kept in memory (0 for no limit).
+ *                    FAT blocks are read when first needed rather than at
+ *                    mount time; beyond this many, the least recently used
+ *                    unchanged one is dropped. Changed blocks stay in memory
+ *                    until they are written back.
+ */
+struct fs_mount_opts {
+	size_t cache_blocks;
+	int mmap_disk;
+	int aio_threads;
+	size_t fat_cache_blocks;
+};
+
+/**
+ * struct fs_format_opts - Layout options of fs_format()
+ * @root_blocks: Number of root directory blocks (0 means 1), each holding
+ *               %FS_FILE_MAX_COUNT entries
+ * @journal_blocks: Number of journal blocks after the data blocks (0 for no
+ *                  journal, otherwise at least 3; see fs_mkjournal())
+ * @sparse_files: Let files have holes (see fs_lseek())
+ * @inline_files: Keep small files in their directory (see fs_write())
+ *
+ * With @sparse_files or @inline_files, the image gets another signature, so
+ * that older implementations of the format refuse to mount it.
+ */
+struct fs_format_opts {
+	size_t root_blocks;
+	size_t journal_blocks;
+	int sparse_files;
+	int inline_files;
+};
+
+/**
+ * struct fs_check_opts - Options of fs_check()
+ * @threads: Number of threads walking file chains (0 for one per CPU)
+ * @repair: Fix the problems found
+ * @verbose: Print a line for each problem found in a file or directory
+ */
+struct fs_check_opts {
+	int threads;
+	int repair;
+	int verbose;
+};
+
+/**
+ * struct fs_check_report - Outcome of fs_check()
+ * @files: Number of files
+ * @dirs: Number of directories, the root directory included
+ * @used_blocks: Number of data blocks owned by files and directories
+ * @free_blocks: Number of data blocks owned by none, which is what the free
+ *               block map holds once the image is repaired
+ * @bad_pointers: Chains leading out of the data blocks or into a free block
+ * @cycles: Chains looping back on themselves
+ * @cross_links: Chains running into a block owned by another entry
+ * @orphans: Blocks allocated in the FAT but owned by no entry
+ * @size_mismatches: Entries whose size needs more blocks than their chain has
+ */
+struct fs_check_report {
+	size_t files;
+	size_t dirs;
+	size_t used_blocks;
+	size_t free_blocks;
+	size_t bad_pointers;
+	size_t cycles;
+	size_t cross_links;
+	size_t orphans;
+	size_t size_mismatches;
+};
+
+/**
+ * struct fs_completion - Completed asynchronous request
+ * @user_data: Value given to fs_read_async() or fs_write_async()
+ * @ret: Number of bytes read or written, or -1 if the disk failed
+ */
+struct fs_completion {
+	void *user_data;
+	int ret;
+};
+
+/**
+ * struct fs_view - Piece of a file mapped in memory
+ * @data: Address of the first byte
+ * @len: Number of bytes
+ */
+struct fs_view {
+	const void *data;
+	size_t len;
+};
+
+/**
+ * struct fs_op_stats - Statistics of one operation
+ * @calls: Number of calls, failed ones included
+ * @errors: Number of calls that returned -1
+ * @bytes: Number of bytes read or written (reads and writes only)
+ * @total_ns: Time spent in the calls, in nanoseconds
+ * @latency: Latency histogram (see %FS_STATS_BUCKETS)
+ *
+ * The time of asynchronous operations is the time taken to submit them.
+ */
+struct fs_op_stats {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t total_ns;
+	uint64_t latency[FS_STATS_BUCKETS];
+};
+
+/**
+ * struct fs_stats - Runtime statistics of a mounted file system
+ * @ops: Statistics of each operation, indexed by %FS_OP_* values
+ * @block_reads: Number of blocks read from the virtual disk
+ * @block_writes: Number of blocks written to the virtual disk
+ * @read_requests: Number of read requests issued to the virtual disk (a
+ *                 request covers one or more blocks)
+ * @write_requests: Number of write requests issued to the virtual disk
+ * @disk_syncs: Number of times the virtual disk was flushed to stable storage
+ * @cache_hits: Number of block lookups served by the block cache
+ * @cache_misses: Number of block lookups that went to the virtual disk
+ * @fat_hops: Number of FAT entries followed to locate file offsets
+ * @alloc_scans: Number of free block searches
+ * @journal_commits: Number of journal transactions committed
+ *
+ * All counters start at 0 when the file system is mounted.
+ */
+struct fs_stats {
+	struct fs_op_stats ops[FS_OP_COUNT];
+	uint64_t block_reads;
+	uint64_t block_writes;
+	uint64_t read_requests;
+	uint64_t write_requests;
+	uint64_t disk_syncs;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t fat_hops;
+	uint64_t alloc_scans;
+	uint64_t journal_commits;
+};
+
+/**
+ * struct fs_trace_header - Start of a trace file
+ * @magic: %FS_TRACE_MAGIC
+ * @version: %FS_TRACE_VERSION
+ * @reserved: 0
+ */
+struct fs_trace_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/**
+ * struct fs_trace_record - Call recorded in a trace file
+ * @time_ns: Time the call started, in nanoseconds since the trace started
+ * @offset: File offset at the start of reads and writes, offset given to
+ *          fs_lseek(), 0 for other calls
+ * @duration_ns: Time taken by the call, in nanoseconds (saturated)
+ * @size: Byte count of reads and writes, length given to fs_fallocate(),
+ *        advice given to fs_advise(), 0 for other calls
+ * @result: Value returned by the call
+ * @fd: File descriptor the call works on, -1 for calls that take a path
+ * @op: One of the %FS_OP_* values
+ * @path_len: Number of bytes of the path that follows the record (not
+ *            NULL-terminated), for calls that take one
+ *
+ * Records are stored in the order the calls complete, in the byte order of
+ * the machine that wrote them.
+ */
+struct fs_trace_record {
+	uint64_t time_ns;
+	uint64_t offset;
+	uint32_t duration_ns;
+	uint32_t size;
+	int32_t result;
+	int16_t fd;
+	uint8_t op;
+	uint8_t path_len;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -29,6 +290,19 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ex - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount(), but lets the caller tune the mounted file system.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if the block cache cannot be allocated. 0
+ * otherwise.
+ */
+int fs_mount_ex(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,10 +310,112 @@ int fs_mount(const char *diskname);
  * disk file.
  *
  * Return: -1 if no FS is currently mounted, or if the virtual disk cannot be
- * closed, or if there are still open file descriptors. 0 otherwise.
+ * closed, or if there are still open file descriptors, or if cached data or
+ * changed metadata cannot be written back (the file system then stays mounted,
+ * so that fs_umount() can be retried). 0 otherwise.
  */
 int fs_umount(void);
 
+/**
+ * fs_flush - Write back cached data blocks
+ *
+ * Write every dirty block held in the block cache to the virtual disk. Dirty
+ * blocks are otherwise only written back when evicted or at fs_umount().
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be written
+ * back. 0 otherwise.
+ */
+int fs_flush(void);
+
+/**
+ * fs_sync - Make the file system durable
+ *
+ * Write back every dirty cached data block, then the FAT blocks and the root
+ * directory if they changed, and flush the virtual disk file to stable
+ * storage. Metadata changes made by fs_create(), fs_delete() and fs_write()
+ * otherwise only reach the disk at fs_umount(), or in batches on file systems
+ * with a journal (see fs_mkjournal()).
+ *
+ * Return: -1 if no FS is currently mounted, or if something cannot be written
+ * back. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_format - Create a virtual disk holding an empty file system
+ * @diskname: Name of the virtual disk file, replaced if it exists
+ * @data_blocks: Number of data blocks (at most 65535, the last block number
+ *               the FAT can designate)
+ * @opts: Layout options, NULL for a single root directory block and no journal
+ *
+ * Size the FAT for @data_blocks and create the virtual disk file sparse: only
+ * the superblock, the first FAT block and the journal header are written, the
+ * other blocks are holes that read as zeros, so that large images take no time
+ * to create. With @opts NULL the image is laid out as by the reference
+ * formatter.
+ *
+ * Return: -1 if @data_blocks or @opts are out of range (the whole disk cannot
+ * exceed 65535 blocks), or if the file cannot be created or written. 0
+ * otherwise.
+ */
+int fs_format(const char *diskname, size_t data_blocks,
+	      const struct fs_format_opts *opts);
+
+/**
+ * fs_mkjournal - Add a journal to a file system
+ * @diskname: Name of the virtual disk file
+ * @blocks: Number of blocks in the journal (at least 3)
+ *
+ * Reserve the last @blocks data blocks of the file system contained in virtual
+ * disk file @diskname, which must not be mounted, for a metadata journal.
+ *
+ * With a journal, changes to the FAT and to directories are committed to it in
+ * batches, as one sequential write and one flush of the virtual disk file:
+ * after fs_sync() or fs_fsync(), or whenever %FS_JOURNAL_COMMIT_BLOCKS blocks
+ * have changed or the oldest change is %FS_JOURNAL_COMMIT_MS milliseconds old
+ * (checked after every operation that changes metadata). They are written in
+ * place later, when the journal fills up or at fs_umount(). After a crash, the
+ * next mount replays the committed batches, so the FAT and directories are
+ * never half updated. File data is not journaled: it reaches the disk as it
+ * does without a journal.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, if it already has a journal, or if its last @blocks
+ * data blocks are not free. 0 otherwise.
+ */
+int fs_mkjournal(const char *diskname, size_t blocks);
+
+/**
+ * fs_check - Check the consistency of a file system
+ * @diskname: Name of the virtual disk file, which must not be mounted
+ * @opts: Options, or NULL to check with one thread per CPU without repairing
+ * @report: Filled with what was found
+ *
+ * Replay the journal if there is one, read the FAT with one request and every
+ * directory, then walk the chains of all files in parallel. Each data block is
+ * claimed by the first entry whose chain reaches it: chains that lead out of
+ * range, into a free block, back onto themselves or into a block claimed by
+ * another entry are reported. A chain may be longer than the size of its file
+ * (blocks reserved by fs_fallocate()), not shorter, the blocks in the holes of
+ * a sparse file aside; its hole map is claimed too, and only allowed on file
+ * systems formatted with sparse files. The data entries of inline files, only
+ * allowed on file systems formatted with them, must lie in their directory,
+ * look unused and belong to a single file, which they must be large enough to
+ * hold. A final pass over the FAT finds the allocated blocks that no entry
+ * claimed, and counts the free ones.
+ *
+ * With @opts->repair, bad chains are cut before the offending block, files lose
+ * bad inline data, sizes are shrunk to the chains and unclaimed blocks are
+ * freed. Which entry keeps a
+ * block shared by two chains depends on the order the threads reach it.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, if no valid file
+ * system can be located, or if the repairs cannot be written. Otherwise return
+ * the number of problems found (and repaired with @opts->repair).
+ */
+int fs_check(const char *diskname, const struct fs_check_opts *opts,
+	     struct fs_check_report *report);
+
 /**
  * fs_info - Display information about file system
  *
@@ -53,14 +429,13 @@ int fs_info(void);
  * fs_create - Create a new file
  * @filename: File name
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file at path @filename in the mounted file system.
+ * String @filename must be NULL-terminated.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
- * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * file or directory named @filename already exists, or if a name in @filename
+ * is too long, or if the directory is full (the root directory has a fixed
+ * size, other directories grow as needed). 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -68,12 +443,13 @@ int fs_create(const char *filename);
  * fs_delete - Delete a file
  * @filename: File name
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file at path @filename from the mounted file system. Directories
+ * are deleted with fs_rmdir().
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
- * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * there is no file named @filename to delete, or if file @filename is
+ * currently open, or if its blocks cannot all be freed because the FAT cannot
+ * be read (the file is deleted anyway). 0 otherwise.
  */
 int fs_delete(const char *filename);
 
@@ -86,11 +462,46 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @dirname: Directory path
+ *
+ * Create a new and empty directory at path @dirname. A directory is stored as
+ * a file holding directory entries, and grows by one block whenever it is
+ * full. Once a directory has been looked up, it stays in memory, so that
+ * resolving paths through it does not read or scan its blocks again.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dirname is invalid, or if a
+ * file or directory named @dirname already exists, or if the directory that
+ * should hold it is full. 0 otherwise.
+ */
+int fs_mkdir(const char *dirname);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @dirname: Directory path
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory named
+ * @dirname, or if it is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *dirname);
+
+/**
+ * fs_ls_dir - List files in a directory
+ * @dirname: Directory path ("" or "/" for the root directory)
+ *
+ * Same as fs_ls(), for any directory.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory named
+ * @dirname. 0 otherwise.
+ */
+int fs_ls_dir(const char *dirname);
+
 /**
  * fs_open - Open a file
  * @filename: File name
  *
- * Open file named @filename for reading and writing, and return the
+ * Open file at path @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
@@ -137,9 +548,15 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The offset may lie past the end of the file, which does not change its size:
+ * a write there leaves a gap that reads as zeros, and is allocated. On file
+ * systems formatted with sparse files (see struct fs_format_opts), whole blocks
+ * of the gap become a hole instead, which takes no data block. Holes are
+ * recorded in one block per sparse file, referenced by its entry.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the largest file size (4 GiB - 1). 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -159,9 +576,20 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * Data blocks are allocated in a hole (see fs_lseek()) as it is written to. A
+ * file has at most 511 holes: a gap that would need more is allocated and
+ * zeroed, and a write in the middle of a hole that would split it stops short.
+ *
+ * On file systems formatted with inline files (see struct fs_format_opts),
+ * files of up to 279 bytes are kept inline, 31 bytes in each of a few unused
+ * entries of their directory, as long as a quarter of its entries stay free:
+ * reading them takes no data block. A file moves to a data block once it grows
+ * past that, or when its entries are needed for new files.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually written.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * the FAT cannot be read before any byte is written. Otherwise return the
+ * number of bytes actually written.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -180,10 +608,341 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * Holes, and inline files (see fs_write()), are read without any disk access.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * the FAT cannot be read before any byte is read. Otherwise return the number
+ * of bytes actually read (short of the end of the file if the FAT cannot be
+ * read further).
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @len: Number of bytes to reserve, counted from the beginning of the file
+ *
+ * Make sure that the file referenced by file descriptor @fd owns enough data
+ * blocks to hold @len bytes, allocating the missing ones as contiguous runs.
+ * The file size is left unchanged: the reserved blocks are used as the file
+ * grows through fs_write(), which keeps large files in few extents. Holes of a
+ * sparse file count as reserved: they are only allocated as they are written.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there are not enough
+ * free blocks on disk. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t len);
+
+/**
+ * fs_fsync - Make a file durable
+ * @fd: File descriptor
+ *
+ * Write back the dirty cached data blocks of the file referenced by file
+ * descriptor @fd along with the changed metadata, and flush the virtual disk
+ * file to stable storage.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if something cannot be
+ * written back. 0 otherwise.
+ */
+int fs_fsync(int fd);
+
+/**
+ * fs_read_view - Read from a file without copying
+ * @fd: File descriptor
+ * @count: Number of bytes of data to be read
+ * @views: Array filled with the pieces of the file that were read
+ * @max_views: Number of entries in @views
+ *
+ * Same as fs_read(), except that no data is copied: @views is filled with
+ * pointers straight into the mapped virtual disk, one entry per run of
+ * physically contiguous blocks. Fewer than @count bytes are covered if the end
+ * of the file is reached or if @views is full; the file offset is incremented
+ * by the number of bytes covered. The pointed data must not be modified, and
+ * stays valid until the file system is unmounted (later writes to the same
+ * part of the file show through). Each block of a hole gets its own view of a
+ * shared block of zeros, which later writes do not change.
+ *
+ * Return: -1 if no FS is currently mounted, or if it was not mounted with
+ * @mmap_disk, or if file descriptor @fd is invalid (out of bounds or not
+ * currently open), or if the file is inline (see fs_write()), or if @views is
+ * NULL. Otherwise return the number of
+ * entries filled in @views.
+ */
+int fs_read_view(int fd, size_t count, struct fs_view *views, int max_views);
+
+/**
+ * fs_advise - Tell how a file is going to be read
+ * @fd: File descriptor
+ * @advice: One of the %FS_ADVICE_* values
+ *
+ * fs_read() prefetches the next blocks of a file into the block cache in the
+ * background, reading further ahead as long as reads on @fd follow each other
+ * and backing off when they jump around. @advice overrides this heuristic:
+ *
+ * %FS_ADVICE_NORMAL restores it, %FS_ADVICE_SEQUENTIAL always reads ahead as
+ * far as possible, and %FS_ADVICE_RANDOM never reads ahead.
+ * %FS_ADVICE_WILLNEED prefetches the blocks that follow the file offset right
+ * away, and %FS_ADVICE_DONTNEED drops the file's clean blocks from the cache;
+ * neither of them changes the heuristic.
+ *
+ * Nothing is prefetched when the block cache is disabled.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @advice is unknown. 0
+ * otherwise.
+ */
+int fs_advise(int fd, int advice);
+
+/**
+ * fs_read_async - Start reading from a file
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data, valid until completion
+ * @count: Number of bytes of data to be read
+ * @user_data: Value reported with the completion
+ *
+ * Same as fs_read(), except that the whole data blocks of the range are read
+ * in the background, as a batch of disk requests handed to io_uring (or to
+ * worker threads where io_uring is not available). The file offset is
+ * incremented right away, so that several requests can be issued back to back
+ * on the same file descriptor. Content of @buf is undefined until the request
+ * is reported by fs_aio_wait().
+ *
+ * Requests covering the same part of a file are not ordered with respect to
+ * each other, nor to fs_read() and fs_write() calls made while they are in
+ * flight.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * request cannot be started. 0 otherwise.
+ */
+int fs_read_async(int fd, void *buf, size_t count, void *user_data);
+
+/**
+ * fs_write_async - Start writing to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file, valid until completion
+ * @count: Number of bytes of data to be written
+ * @user_data: Value reported with the completion
+ *
+ * Same as fs_write(), except that the whole data blocks of the range are
+ * written in the background, like fs_read_async() does. Blocks are allocated
+ * and the file size is updated right away. fs_fsync(), fs_sync() and
+ * fs_umount() wait for every write in flight.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * request cannot be started. 0 otherwise.
+ */
+int fs_write_async(int fd, void *buf, size_t count, void *user_data);
+
+/**
+ * fs_aio_wait - Collect completed asynchronous requests
+ * @events: Array filled with the completed requests
+ * @min: Number of requests to wait for
+ * @max: Number of entries in @events
+ *
+ * Fill @events with up to @max completed requests, in completion order,
+ * blocking until at least @min of them have completed. Fewer than @min entries
+ * are returned when fewer requests are outstanding.
+ *
+ * Return: -1 if no FS is currently mounted, or if @events is NULL. Otherwise
+ * return the number of entries filled in @events.
+ */
+int fs_aio_wait(struct fs_completion *events, int min, int max);
+
+/**
+ * fs_defrag - Make files contiguous, a bit at a time
+ * @budget: Largest number of data blocks to move
+ *
+ * Move the blocks of files spread over several runs to a free run large
+ * enough to hold each file whole, updating the FAT and the files' entries.
+ * Files are visited in directory order, subdirectories included; directory
+ * files, and files for which no free run is large enough, stay in place.
+ *
+ * Each call copies at most @budget blocks and picks up where the last one
+ * stopped, so that a volume can be defragmented in the background while in
+ * use: other calls wait while blocks move, and a file written to in between
+ * carries on being moved if its first blocks are still in place. Blocks are
+ * copied before the chain is relinked, so that the file system is consistent
+ * after a crash whenever it has a journal. Views from fs_read_view() on a
+ * moved file are no longer valid.
+ *
+ * Return: -1 if no FS is currently mounted, or if a block cannot be read or
+ * written. Otherwise return the number of blocks moved, 0 once no file can be
+ * made contiguous.
+ */
+int fs_defrag(size_t budget);
+
+/**
+ * fs_stats - Get runtime statistics
+ * @stats: Filled with the statistics of the currently mounted file system
+ *
+ * Counting is always on; it costs a few atomic additions per call. Counters
+ * are read one at a time while other threads may update them, so they need
+ * not be consistent with each other.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_trace_start - Start recording calls to a trace file
+ * @filename: Name of the trace file, truncated if it exists
+ *
+ * Append a &struct fs_trace_record to @filename for every call counted by
+ * fs_stats(), until fs_trace_stop() or fs_umount(). The data read or written
+ * is not recorded. Tracing is off by default; it serializes the end of every
+ * call on a lock, and records are written out in large chunks.
+ *
+ * When the environment variable FS_TRACE names a file, fs_mount() and
+ * fs_mount_ex() start a trace to that file, so that the calls of a program can
+ * be captured without changing it.
+ *
+ * Return: -1 if no FS is currently mounted, or if a trace is already being
+ * recorded, or if @filename cannot be created. 0 otherwise.
+ */
+int fs_trace_start(const char *filename);
+
+/**
+ * fs_trace_stop - Stop recording calls
+ *
+ * Return: -1 if no FS is currently mounted, or if no trace is being recorded,
+ * or if the trace file could not be written completely. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+/**
+ * fs_op_name - Get the name of an operation
+ * @op: One of the %FS_OP_* values
+ *
+ * Return: NULL if @op is unknown. The name of the operation ("read", "write",
+ * ...) otherwise.
+ */
+const char *fs_op_name(int op);
+
+/** Opaque handle on a mounted file system */
+struct fs_ctx;
+
+/**
+ * fs_ctx_mount - Mount a file system and get a handle on it
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults used by fs_mount()
+ *
+ * Same as fs_mount_ex(), except that the mounted file system is only reachable
+ * through the returned handle. It does not interfere with the file system
+ * mounted by fs_mount() nor with other handles, as long as they use different
+ * virtual disk files.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, if no valid
+ * file system can be located, or if memory cannot be allocated. A handle on
+ * the mounted file system otherwise.
+ */
+struct fs_ctx *fs_ctx_mount(const char *diskname,
+			    const struct fs_mount_opts *opts);
+
+/**
+ * fs_ctx_umount - Unmount a file system and release its handle
+ * @ctx: File system handle
+ *
+ * Same as fs_umount(). On success, @ctx is released and must not be used
+ * anymore; no other thread may be using it at that point.
+ *
+ * Return: -1 if @ctx is NULL, or if there are still open file descriptors. 0
+ * otherwise.
+ */
+int fs_ctx_umount(struct fs_ctx *ctx);
+
+/** fs_ctx_flush - Same as fs_flush(), on file system @ctx */
+int fs_ctx_flush(struct fs_ctx *ctx);
+
+/** fs_ctx_sync - Same as fs_sync(), on file system @ctx */
+int fs_ctx_sync(struct fs_ctx *ctx);
+
+/** fs_ctx_info - Same as fs_info(), on file system @ctx */
+int fs_ctx_info(struct fs_ctx *ctx);
+
+/** fs_ctx_create - Same as fs_create(), on file system @ctx */
+int fs_ctx_create(struct fs_ctx *ctx, const char *filename);
+
+/** fs_ctx_delete - Same as fs_delete(), on file system @ctx */
+int fs_ctx_delete(struct fs_ctx *ctx, const char *filename);
+
+/** fs_ctx_ls - Same as fs_ls(), on file system @ctx */
+int fs_ctx_ls(struct fs_ctx *ctx);
+
+/** fs_ctx_mkdir - Same as fs_mkdir(), on file system @ctx */
+int fs_ctx_mkdir(struct fs_ctx *ctx, const char *dirname);
+
+/** fs_ctx_rmdir - Same as fs_rmdir(), on file system @ctx */
+int fs_ctx_rmdir(struct fs_ctx *ctx, const char *dirname);
+
+/** fs_ctx_ls_dir - Same as fs_ls_dir(), on file system @ctx */
+int fs_ctx_ls_dir(struct fs_ctx *ctx, const char *dirname);
+
+/**
+ * fs_ctx_open - Same as fs_open(), on file system @ctx
+ *
+ * The returned file descriptor is only valid with @ctx.
+ */
+int fs_ctx_open(struct fs_ctx *ctx, const char *filename);
+
+/** fs_ctx_close - Same as fs_close(), on file system @ctx */
+int fs_ctx_close(struct fs_ctx *ctx, int fd);
+
+/** fs_ctx_stat - Same as fs_stat(), on file system @ctx */
+int fs_ctx_stat(struct fs_ctx *ctx, int fd);
+
+/** fs_ctx_lseek - Same as fs_lseek(), on file system @ctx */
+int fs_ctx_lseek(struct fs_ctx *ctx, int fd, size_t offset);
+
+/** fs_ctx_write - Same as fs_write(), on file system @ctx */
+int fs_ctx_write(struct fs_ctx *ctx, int fd, void *buf, size_t count);
+
+/** fs_ctx_read - Same as fs_read(), on file system @ctx */
+int fs_ctx_read(struct fs_ctx *ctx, int fd, void *buf, size_t count);
+
+/** fs_ctx_fallocate - Same as fs_fallocate(), on file system @ctx */
+int fs_ctx_fallocate(struct fs_ctx *ctx, int fd, size_t len);
+
+/** fs_ctx_fsync - Same as fs_fsync(), on file system @ctx */
+int fs_ctx_fsync(struct fs_ctx *ctx, int fd);
+
+/** fs_ctx_read_view - Same as fs_read_view(), on file system @ctx */
+int fs_ctx_read_view(struct fs_ctx *ctx, int fd, size_t count,
+		     struct fs_view *views, int max_views);
+
+/** fs_ctx_advise - Same as fs_advise(), on file system @ctx */
+int fs_ctx_advise(struct fs_ctx *ctx, int fd, int advice);
+
+/** fs_ctx_read_async - Same as fs_read_async(), on file system @ctx */
+int fs_ctx_read_async(struct fs_ctx *ctx, int fd, void *buf, size_t count,
+		      void *user_data);
+
+/** fs_ctx_write_async - Same as fs_write_async(), on file system @ctx */
+int fs_ctx_write_async(struct fs_ctx *ctx, int fd, void *buf, size_t count,
+		       void *user_data);
+
+/** fs_ctx_defrag - Same as fs_defrag(), on file system @ctx */
+int fs_ctx_defrag(struct fs_ctx *ctx, size_t budget);
+
+/** fs_ctx_stats - Same as fs_stats(), on file system @ctx */
+int fs_ctx_stats(struct fs_ctx *ctx, struct fs_stats *stats);
+
+/** fs_ctx_trace_start - Same as fs_trace_start(), on file system @ctx */
+int fs_ctx_trace_start(struct fs_ctx *ctx, const char *filename);
+
+/** fs_ctx_trace_stop - Same as fs_trace_stop(), on file system @ctx */
+int fs_ctx_trace_stop(struct fs_ctx *ctx);
+
+/**
+ * fs_ctx_aio_wait - Same as fs_aio_wait(), on file system @ctx
+ *
+ * Only requests started on @ctx are reported.
+ */
+int fs_ctx_aio_wait(struct fs_ctx *ctx, struct fs_completion *events, int min,
+		    int max);
+
 #endif /* _FS_H */
@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "journal.h"
+
+/* Tell journal blocks apart from stale data */
+#define HEADER_MAGIC 0x45434a4e4c484452ULL
+#define DESC_MAGIC 0x45434a4e4c444553ULL
+
+/* Block numbers that fit in a descriptor after its fixed fields */
+#define DESC_MAX_TARGETS ((BLOCK_SIZE - 24) / 4)
+
+struct __attribute__((packed)) journal_header {
+	uint64_t magic;
+	uint64_t seq;	/* sequence number of the first transaction */
+	uint8_t padding[BLOCK_SIZE - 16];
+};
+
+struct __attribute__((packed)) journal_desc {
+	uint64_t magic;
+	uint64_t seq;
+	uint32_t count;
+	uint32_t checksum;	/* of the descriptor (with 0 here) and the images */
+	uint32_t targets[DESC_MAX_TARGETS];
+};
+
+/*
+ * Transactions are numbered; the header holds the number expected in block 1,
+ * and each transaction is followed by the next number. Transactions left over
+ * from before the last reset have lower numbers, so replay stops at the first
+ * block that does not hold the expected one, or whose checksum is wrong (a
+ * transaction torn by a crash).
+ */
+struct journal {
+	struct disk *disk;
+	size_t start;
+	size_t nblocks;
+	uint64_t seq;	/* number of the next transaction */
+	size_t head;	/* block where the next transaction goes */
+	size_t replayed;
+};
+
+static uint32_t checksum(uint32_t sum, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	/* FNV-1a */
+	for (size_t i = 0; i < len; i++) {
+		sum ^= p[i];
+		sum *= 16777619u;
+	}
+	return sum;
+}
+
+static uint32_t desc_checksum(const struct journal_desc *desc,
+			      const void *const *images)
+{
+	struct journal_desc copy = *desc;
+	uint32_t sum = 2166136261u;
+
+	copy.checksum = 0;
+	sum = checksum(sum, &copy, BLOCK_SIZE);
+	for (uint32_t i = 0; i < desc->count; i++)
+		sum = checksum(sum, images[i], BLOCK_SIZE);
+	return sum;
+}
+
+static int write_header(struct disk *disk, size_t start, uint64_t seq)
+{
+	struct journal_header header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = HEADER_MAGIC;
+	header.seq = seq;
+	return disk_write(disk, start, &header);
+}
+
+int journal_format(struct disk *disk, size_t start, size_t nblocks)
+{
+	if (nblocks < 3)
+		return -1;
+	return write_header(disk, start, 1);
+}
+
+/*
+ * Write in place the blocks of the complete transactions held in @region (a
+ * copy of the whole journal). Returns the number of transactions replayed and
+ * sets @next to the number following the last one.
+ */
+static int replay(struct journal *j, const uint8_t *region, size_t limit,
+		  uint64_t *next)
+{
+	const struct journal_header *header = (const void *)region;
+	const void *images[DESC_MAX_TARGETS];
+	size_t pos = 1;
+	int count = 0;
+
+	*next = header->seq;
+	while (pos < j->nblocks) {
+		const struct journal_desc *desc =
+			(const void *)&region[pos * BLOCK_SIZE];
+
+		if (desc->magic != DESC_MAGIC || desc->seq != *next ||
+		    desc->count == 0 || desc->count > DESC_MAX_TARGETS ||
+		    desc->count > j->nblocks - pos - 1)
+			break;
+		for (uint32_t i = 0; i < desc->count; i++)
+			images[i] = &region[(pos + 1 + i) * BLOCK_SIZE];
+		if (desc_checksum(desc, images) != desc->checksum)
+			break;
+
+		for (uint32_t i = 0; i < desc->count; i++) {
+			if (desc->targets[i] >= limit)
+				return -1;
+			if (disk_write(j->disk, desc->targets[i], images[i]))
+				return -1;
+		}
+		pos += 1 + desc->count;
+		(*next)++;
+		count++;
+	}
+	return count;
+}
+
+struct journal *journal_open(struct disk *disk, size_t start, size_t nblocks,
+			     size_t limit)
+{
+	struct journal *j;
+	uint8_t *region;
+
+	if (nblocks < 3)
+		return NULL;
+	j = malloc(sizeof(*j));
+	region = malloc(nblocks * BLOCK_SIZE);
+	if (!j || !region)
+		goto fail;
+
+	j->disk = disk;
+	j->start = start;
+	j->nblocks = nblocks;
+	j->head = 1;
+	j->replayed = 0;
+
+	/* The whole journal comes in with one sequential read */
+	if (disk_read_range(disk, start, nblocks, region))
+		goto fail;
+
+	if (((struct journal_header *)region)->magic != HEADER_MAGIC) {
+		j->seq = 1;
+		if (write_header(disk, start, j->seq))
+			goto fail;
+	} else {
+		int count = replay(j, region, limit, &j->seq);
+
+		if (count < 0)
+			goto fail;
+		if (count > 0) {
+			/* The replayed blocks must be durable before the
+			 * transactions are forgotten */
+			if (disk_sync(disk) || write_header(disk, start, j->seq) ||
+			    disk_sync(disk))
+				goto fail;
+			j->replayed = count;
+		}
+	}
+
+	free(region);
+	return j;
+
+fail:
+	free(region);
+	free(j);
+	return NULL;
+}
+
+void journal_close(struct journal *j)
+{
+	free(j);
+}
+
+size_t journal_replayed(const struct journal *j)
+{
+	return j->replayed;
+}
+
+size_t journal_capacity(const struct journal *j)
+{
+	size_t n = j->nblocks - 2;
+
+	return n < DESC_MAX_TARGETS ? n : DESC_MAX_TARGETS;
+}
+
+size_t journal_room(const struct journal *j)
+{
+	size_t n = j->nblocks - j->head;
+
+	if (n < 2)
+		return 0;
+	n--;
+	return n < DESC_MAX_TARGETS ? n : DESC_MAX_TARGETS;
+}
+
+int journal_is_empty(const struct journal *j)
+{
+	return j->head == 1;
+}
+
+int journal_commit(struct journal *j, const size_t *targets,
+		   const void *const *images, size_t count)
+{
+	struct journal_desc desc;
+	const void *bufs[DESC_MAX_TARGETS + 1];
+
+	if (count == 0 || count > journal_room(j))
+		return -1;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.magic = DESC_MAGIC;
+	desc.seq = j->seq;
+	desc.count = count;
+	for (size_t i = 0; i < count; i++)
+		desc.targets[i] = targets[i];
+	desc.checksum = desc_checksum(&desc, images);
+
+	/* Descriptor and images go out in one vectored write */
+	bufs[0] = &desc;
+	memcpy(&bufs[1], images, count * sizeof(*images));
+	if (disk_writev(j->disk, j->start + j->head, bufs, count + 1))
+		return -1;
+
+	j->head += count + 1;
+	j->seq++;
+	return 0;
+}
+
+int journal_reset(struct journal *j)
+{
+	if (journal_is_empty(j))
+		return 0;
+	if (write_header(j->disk, j->start, j->seq))
+		return -1;
+	j->head = 1;
+	return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/*
+ * Write-ahead journal kept in a region of consecutive disk blocks. Its first
+ * block is a header; the others hold transactions written back to back, each
+ * one a descriptor block (target block numbers and a checksum) followed by the
+ * images of the blocks. A transaction is written with one request and counts
+ * once it is complete on disk; replay copies the complete ones in place.
+ */
+
+/** Opaque journal handle */
+struct journal;
+
+/**
+ * journal_format - Set up an empty journal
+ * @disk: Virtual disk handle
+ * @start: First block of the journal region
+ * @nblocks: Number of blocks in the region (at least 3)
+ *
+ * Return: -1 if the header cannot be written. 0 otherwise.
+ */
+int journal_format(struct disk *disk, size_t start, size_t nblocks);
+
+/**
+ * journal_open - Open a journal and replay it
+ * @disk: Virtual disk handle
+ * @start: First block of the journal region
+ * @nblocks: Number of blocks in the region
+ * @limit: Blocks from @limit onwards are never written by a replay
+ *
+ * Read the whole region in one request, write the blocks of every complete
+ * transaction in place, flush them to stable storage, and empty the journal.
+ * A region that holds no valid header is formatted.
+ *
+ * Return: NULL if the region cannot be read or written, or if memory cannot
+ * be allocated. The journal, ready for new transactions, otherwise.
+ */
+struct journal *journal_open(struct disk *disk, size_t start, size_t nblocks,
+			     size_t limit);
+
+/**
+ * journal_close - Release a journal handle
+ * @j: Journal
+ */
+void journal_close(struct journal *j);
+
+/**
+ * journal_replayed - Get the number of transactions replayed by journal_open()
+ * @j: Journal
+ */
+size_t journal_replayed(const struct journal *j);
+
+/**
+ * journal_capacity - Get the largest number of blocks in one transaction
+ * @j: Journal
+ */
+size_t journal_capacity(const struct journal *j);
+
+/**
+ * journal_room - Get the number of blocks a transaction can hold right now
+ * @j: Journal
+ *
+ * Return: 0 if the journal is full and must be emptied with journal_reset().
+ */
+size_t journal_room(const struct journal *j);
+
+/**
+ * journal_is_empty - Tell whether transactions were committed since the last
+ * reset
+ * @j: Journal
+ */
+int journal_is_empty(const struct journal *j);
+
+/**
+ * journal_commit - Commit a transaction
+ * @j: Journal
+ * @targets: Block where each image belongs
+ * @images: Array of @count buffers of %BLOCK_SIZE bytes each
+ * @count: Number of blocks, at most journal_room()
+ *
+ * Append the transaction to the journal with one vectored write. It is durable
+ * once the virtual disk file is flushed with disk_sync(), which the caller
+ * does (possibly along with other writes). The blocks are not written in
+ * place.
+ *
+ * Return: -1 if @count is too large or if the disk fails. 0 otherwise.
+ */
+int journal_commit(struct journal *j, const size_t *targets,
+		   const void *const *images, size_t count);
+
+/**
+ * journal_reset - Empty the journal
+ * @j: Journal
+ *
+ * Forget every committed transaction. The caller must have written their
+ * blocks in place and flushed them to stable storage first.
+ *
+ * Return: -1 if the header cannot be written. 0 otherwise.
+ */
+int journal_reset(struct journal *j);
+
+#endif /* _JOURNAL_H */
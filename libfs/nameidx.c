@@ -0,0 +1,132 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nameidx.h"
+
+/* Marks an empty slot */
+#define NO_VALUE -1
+
+struct slot {
+	uint32_t hash;
+	int value;
+};
+
+/*
+ * Open addressing with linear probing. The table is kept at most half full so
+ * that probe sequences stay short, and removals shift the following entries
+ * back instead of leaving tombstones, so lookups never slow down over time.
+ */
+struct name_index {
+	size_t capacity;
+	size_t count;
+	size_t mask;
+	struct slot *slots;
+	nameidx_key_fn key;
+	const void *arg;
+};
+
+/* FNV-1a */
+static uint32_t hashName(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name) {
+		h ^= (uint8_t)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct name_index *nameidx_create(size_t capacity, nameidx_key_fn key,
+				  const void *arg)
+{
+	struct name_index *idx = malloc(sizeof(*idx));
+	if (idx == NULL)
+		return NULL;
+
+	size_t nslots = 2;
+	while (nslots < 2 * capacity)
+		nslots <<= 1;
+
+	idx->capacity = capacity;
+	idx->count = 0;
+	idx->mask = nslots - 1;
+	idx->key = key;
+	idx->arg = arg;
+	idx->slots = malloc(nslots * sizeof(*idx->slots));
+	if (idx->slots == NULL) {
+		free(idx);
+		return NULL;
+	}
+	for (size_t i = 0; i < nslots; i++)
+		idx->slots[i].value = NO_VALUE;
+	return idx;
+}
+
+void nameidx_destroy(struct name_index *idx)
+{
+	free(idx->slots);
+	free(idx);
+}
+
+/* Slot holding @name, or NO_VALUE */
+static long findSlot(const struct name_index *idx, const char *name,
+		     uint32_t hash)
+{
+	for (size_t i = hash & idx->mask; ; i = (i + 1) & idx->mask) {
+		const struct slot *s = &idx->slots[i];
+		if (s->value == NO_VALUE)
+			return NO_VALUE;
+		if (s->hash == hash &&
+		    strcmp(idx->key(idx->arg, s->value), name) == 0)
+			return i;
+	}
+}
+
+int nameidx_insert(struct name_index *idx, const char *name, int value)
+{
+	if (idx->count >= idx->capacity)
+		return -1;
+
+	uint32_t hash = hashName(name);
+	size_t i = hash & idx->mask;
+	while (idx->slots[i].value != NO_VALUE)
+		i = (i + 1) & idx->mask;
+	idx->slots[i].hash = hash;
+	idx->slots[i].value = value;
+	idx->count++;
+	return 0;
+}
+
+int nameidx_lookup(const struct name_index *idx, const char *name)
+{
+	long i = findSlot(idx, name, hashName(name));
+	return i == NO_VALUE ? NO_VALUE : idx->slots[i].value;
+}
+
+int nameidx_remove(struct name_index *idx, const char *name)
+{
+	long found = findSlot(idx, name, hashName(name));
+	if (found == NO_VALUE)
+		return NO_VALUE;
+
+	int value = idx->slots[found].value;
+	size_t hole = found;
+	size_t i = hole;
+	for (;;) {
+		i = (i + 1) & idx->mask;
+		if (idx->slots[i].value == NO_VALUE)
+			break;
+		/* Move the entry back if the hole lies between its home slot
+		 * and where it currently sits */
+		size_t home = idx->slots[i].hash & idx->mask;
+		if (((i - home) & idx->mask) >= ((i - hole) & idx->mask)) {
+			idx->slots[hole] = idx->slots[i];
+			hole = i;
+		}
+	}
+	idx->slots[hole].value = NO_VALUE;
+	idx->count--;
+	return value;
+}
@@ -0,0 +1,68 @@
+#ifndef _NAMEIDX_H
+#define _NAMEIDX_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Opaque name index */
+struct name_index;
+
+/**
+ * nameidx_key_fn - Get the name stored under a value
+ * @arg: Argument given to nameidx_create()
+ * @value: Value inserted in the index
+ *
+ * The index does not copy names: it calls this function whenever it needs to
+ * compare the name stored under @value with the one being looked up.
+ */
+typedef const char *(*nameidx_key_fn)(const void *arg, int value);
+
+/**
+ * nameidx_create - Create a name index
+ * @capacity: Maximum number of names held at once
+ * @key: Function giving the name stored under a value
+ * @arg: Argument passed to @key
+ *
+ * Create a hash index mapping NULL-terminated names to non-negative values
+ * (e.g. positions in a table of directory entries). Insertions, lookups and
+ * removals take constant time on average, whatever the number of names.
+ *
+ * Return: NULL if memory cannot be allocated. The new index otherwise.
+ */
+struct name_index *nameidx_create(size_t capacity, nameidx_key_fn key,
+				  const void *arg);
+
+/**
+ * nameidx_destroy - Release a name index
+ * @idx: Name index
+ */
+void nameidx_destroy(struct name_index *idx);
+
+/**
+ * nameidx_insert - Add a name to the index
+ * @idx: Name index
+ * @name: Name, which @key must return for @value from now on
+ * @value: Non-negative value
+ *
+ * Return: -1 if the index already holds @capacity names. 0 otherwise.
+ */
+int nameidx_insert(struct name_index *idx, const char *name, int value);
+
+/**
+ * nameidx_lookup - Find a name in the index
+ * @idx: Name index
+ * @name: Name
+ *
+ * Return: -1 if @name is not in the index. Its value otherwise.
+ */
+int nameidx_lookup(const struct name_index *idx, const char *name);
+
+/**
+ * nameidx_remove - Remove a name from the index
+ * @idx: Name index
+ * @name: Name, which @key must still return for its value
+ *
+ * Return: -1 if @name is not in the index. Its value otherwise.
+ */
+int nameidx_remove(struct name_index *idx, const char *name);
+
+#endif /* _NAMEIDX_H */
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs.h"
+#include "trace.h"
+
+/* Records are written out in chunks of this many bytes */
+#define TRACE_BUF_SIZE (64 * 1024)
+
+struct trace {
+	FILE *file;
+	uint64_t base;	/* time of the start of the trace */
+	int failed;	/* a write failed; later records are dropped */
+	char buf[TRACE_BUF_SIZE];
+};
+
+struct trace *trace_open(const char *filename, uint64_t now)
+{
+	struct fs_trace_header header;
+	struct trace *t = malloc(sizeof(*t));
+
+	if (!t)
+		return NULL;
+	t->file = fopen(filename, "wb");
+	if (!t->file) {
+		free(t);
+		return NULL;
+	}
+	setvbuf(t->file, t->buf, _IOFBF, sizeof(t->buf));
+	t->base = now;
+	t->failed = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = FS_TRACE_MAGIC;
+	header.version = FS_TRACE_VERSION;
+	if (fwrite(&header, sizeof(header), 1, t->file) != 1) {
+		fclose(t->file);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+int trace_record(struct trace *t, struct fs_trace_record *rec,
+		 const char *path)
+{
+	size_t len = path ? strnlen(path, UINT8_MAX) : 0;
+
+	if (t->failed)
+		return -1;
+	rec->time_ns = rec->time_ns > t->base ? rec->time_ns - t->base : 0;
+	rec->path_len = len;
+	if (fwrite(rec, sizeof(*rec), 1, t->file) != 1 ||
+	    (len && fwrite(path, len, 1, t->file) != 1)) {
+		t->failed = 1;
+		return -1;
+	}
+	return 0;
+}
+
+int trace_close(struct trace *t)
+{
+	int ret = t->failed ? -1 : 0;
+
+	if (fclose(t->file))
+		ret = -1;
+	free(t);
+	return ret;
+}
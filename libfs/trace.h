@@ -0,0 +1,48 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * Writer of operation traces in the format described in fs.h: a header
+ * followed by one &struct fs_trace_record per call, each one followed by the
+ * path it names if any. Records are buffered and written in large chunks.
+ */
+
+/** Opaque trace handle */
+struct trace;
+
+/**
+ * trace_open - Create a trace file
+ * @filename: Name of the file, truncated if it exists
+ * @now: Current time in nanoseconds; record times are relative to it
+ *
+ * Return: NULL if the file cannot be created or if memory cannot be allocated.
+ * The trace handle otherwise.
+ */
+struct trace *trace_open(const char *filename, uint64_t now);
+
+/**
+ * trace_record - Append a record
+ * @t: Trace
+ * @rec: Record; its @time_ns is absolute and @path_len is filled here
+ * @path: Path named by the call, or NULL
+ *
+ * The caller serializes calls on the same trace.
+ *
+ * Return: -1 if the file cannot be written. 0 otherwise.
+ */
+int trace_record(struct trace *t, struct fs_trace_record *rec,
+		 const char *path);
+
+/**
+ * trace_close - Write out the buffered records and close the trace
+ * @t: Trace
+ *
+ * Return: -1 if the file cannot be written. 0 otherwise.
+ */
+int trace_close(struct trace *t);
+
+#endif /* _TRACE_H */